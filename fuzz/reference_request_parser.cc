@@ -0,0 +1,93 @@
+#include "reference_request_parser.h"
+
+#include <cstring>
+#include <string>
+
+namespace simple_http_server {
+
+namespace {
+
+const char* const kMethods[] = {"GET",     "HEAD",    "POST",
+                                "PUT",     "DELETE",  "CONNECT",
+                                "OPTIONS", "TRACE",   "PATCH"};
+
+// tchar (RFC 7230, section 3.2.6)
+bool is_token_char(unsigned char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') ||
+         (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != nullptr);
+}
+
+// VCHAR or obs-text
+bool is_visible_char(unsigned char c) { return c > 0x20 && c != 0x7F; }
+
+bool is_optional_whitespace(unsigned char c) { return c == ' ' || c == '\t'; }
+
+bool consume(const std::string& input, size_t* position, const char* text) {
+  size_t length = strlen(text);
+  if (input.compare(*position, length, text) != 0) return false;
+  *position += length;
+  return true;
+}
+
+}  // namespace
+
+bool reference_parse_request(const std::string& input,
+                             ReferenceRequest* request) {
+  size_t position = 0;
+  *request = ReferenceRequest();
+
+  // request-line = method SP request-target SP HTTP-version CRLF
+  while (position < input.length() && is_token_char(input[position])) {
+    request->method.push_back(input[position++]);
+  }
+  if (!consume(input, &position, " ")) return false;
+  while (position < input.length() && is_visible_char(input[position])) {
+    request->target.push_back(input[position++]);
+  }
+  if (request->target.empty() || !consume(input, &position, " ")) {
+    return false;
+  }
+  if (consume(input, &position, "HTTP/1.0")) {
+    request->version = "HTTP/1.0";
+  } else if (consume(input, &position, "HTTP/1.1")) {
+    request->version = "HTTP/1.1";
+  } else {
+    return false;
+  }
+  if (!consume(input, &position, "\r\n")) return false;
+
+  bool known_method = false;
+  for (const char* method : kMethods) {
+    if (request->method == method) known_method = true;
+  }
+  if (!known_method) return false;
+
+  // header-field = field-name ":" OWS field-value OWS
+  while (!consume(input, &position, "\r\n")) {
+    std::string name, value;
+    while (position < input.length() && is_token_char(input[position])) {
+      name.push_back(input[position++]);
+    }
+    if (name.empty() || !consume(input, &position, ":")) return false;
+    while (position < input.length() &&
+           is_optional_whitespace(input[position])) {
+      position++;
+    }
+    while (position < input.length() &&
+           (is_visible_char(input[position]) ||
+            is_optional_whitespace(input[position]))) {
+      value.push_back(input[position++]);
+    }
+    while (!value.empty() && is_optional_whitespace(value.back())) {
+      value.pop_back();
+    }
+    if (!consume(input, &position, "\r\n")) return false;
+    request->headers.emplace_back(name, value);
+  }
+
+  request->body = input.substr(position);
+  return true;
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,31 @@
+// Defines a strict parser of HTTP/1.x requests, written independently of
+// string_to_request() straight from the grammar of RFC 7230. It serves as
+// the reference of the differential fuzzer.
+
+#ifndef REFERENCE_REQUEST_PARSER_H_
+#define REFERENCE_REQUEST_PARSER_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace simple_http_server {
+
+struct ReferenceRequest {
+  std::string method;
+  std::string target;
+  std::string version;
+  // in the order they were received, duplicates included
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+};
+
+// Returns false unless `input` is a complete request the server supports:
+// a known method, HTTP/1.0 or HTTP/1.1, and well-formed header fields
+// followed by an empty line. Everything after the empty line is the body.
+bool reference_parse_request(const std::string& input,
+                             ReferenceRequest* request);
+
+}  // namespace simple_http_server
+
+#endif  // REFERENCE_REQUEST_PARSER_H_
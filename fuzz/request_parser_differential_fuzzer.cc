@@ -0,0 +1,65 @@
+// Compares string_to_request() with the strict reference parser. The server
+// may accept more than the grammar allows, such as lowercase methods, but it
+// must accept every request the reference accepts, and read it the same way.
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+
+#include "http_message.h"
+#include "reference_request_parser.h"
+
+using simple_http_server::HttpHeaders;
+using simple_http_server::HttpRequest;
+using simple_http_server::ReferenceRequest;
+
+namespace {
+
+void check(bool condition, const char* message, const std::string& input) {
+  if (!condition) {
+    fprintf(stderr, "request_parser_differential_fuzzer: %s\n%s\n", message,
+            input.c_str());
+    abort();
+  }
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, size_t size) {
+  std::string input(reinterpret_cast<const char*>(data), size);
+  ReferenceRequest expected;
+  HttpRequest request;
+
+  bool valid = simple_http_server::reference_parse_request(input, &expected);
+  try {
+    request = simple_http_server::string_to_request(input);
+  } catch (const std::exception& e) {
+    check(!valid, e.what(), input);
+    return 0;
+  }
+  if (!valid) return 0;
+
+  // The server lowercases the path, keeps the last of repeated header
+  // fields and sets Content-Length to the length of whatever follows the
+  // header, since it does not read past one request
+  std::string path = expected.target;
+  for (char& c : path) c = tolower(static_cast<unsigned char>(c));
+  HttpHeaders headers;
+  for (const auto& header : expected.headers) {
+    headers[header.first] = header.second;
+  }
+  headers["Content-Length"] = std::to_string(expected.body.length());
+
+  check(simple_http_server::to_string(request.method()) == expected.method,
+        "method differs", input);
+  check(request.uri().path() == path, "path differs", input);
+  check(simple_http_server::to_string(request.version()) == expected.version,
+        "version differs", input);
+  check(request.headers() == headers, "headers differ", input);
+  check(request.content() == expected.body, "content differs", input);
+  return 0;
+}
@@ -0,0 +1,67 @@
+// Feeds arbitrary bytes to string_to_request(). Any crash, sanitizer report
+// or unexpected exception is a bug; so is a request that does not survive a
+// round trip through to_string().
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include "http_message.h"
+
+using simple_http_server::HttpRequest;
+using simple_http_server::HttpResponse;
+using simple_http_server::HttpStatusCode;
+
+namespace {
+
+void check(bool condition, const char* message) {
+  if (!condition) {
+    fprintf(stderr, "request_parser_fuzzer: %s\n", message);
+    abort();
+  }
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, size_t size) {
+  std::string input(reinterpret_cast<const char*>(data), size);
+  HttpRequest request;
+
+  // invalid_argument and logic_error are how the parser rejects a request,
+  // the server answers them with 400 and 505. Their other subclasses come
+  // from misusing the standard library.
+  try {
+    request = simple_http_server::string_to_request(input);
+  } catch (const std::out_of_range&) {
+    throw;
+  } catch (const std::length_error&) {
+    throw;
+  } catch (const std::logic_error&) {
+    return 0;
+  }
+
+  std::string serialized = simple_http_server::to_string(request);
+  HttpRequest reparsed;
+  try {
+    reparsed = simple_http_server::string_to_request(serialized);
+  } catch (const std::exception&) {
+    check(false, "a serialized request is rejected");
+  }
+  check(reparsed.method() == request.method(), "method differs");
+  check(reparsed.uri() == request.uri(), "path differs");
+  check(reparsed.version() == request.version(), "version differs");
+  check(reparsed.headers() == request.headers(), "headers differ");
+  check(reparsed.content() == request.content(), "content differs");
+
+  // echo the request, as a handler would
+  HttpResponse response(HttpStatusCode::Ok);
+  for (const auto& header : request.headers()) {
+    response.SetHeader(header.first, header.second);
+  }
+  response.SetContent(request.content());
+  simple_http_server::to_string(response);
+  return 0;
+}
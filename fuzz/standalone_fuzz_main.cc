@@ -0,0 +1,60 @@
+// Runs a fuzz target over files instead of generated inputs, for compilers
+// without libFuzzer. Each argument is a file or a directory of files, such
+// as a corpus or the crash inputs saved by a fuzzer. Also serves as the
+// driver of AFL++ (afl-fuzz ... -- fuzzer @@).
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, size_t size);
+
+namespace {
+
+void run_file(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> input((std::istreambuf_iterator<char>(file)),
+                          std::istreambuf_iterator<char>());
+  LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(input.data()),
+                         input.size());
+}
+
+// Returns the number of inputs that were run
+size_t run_path(const std::string& path) {
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0) {
+    fprintf(stderr, "Cannot open %s\n", path.c_str());
+    return 0;
+  }
+  if (!S_ISDIR(status.st_mode)) {
+    run_file(path);
+    return 1;
+  }
+
+  size_t count = 0;
+  DIR* directory = opendir(path.c_str());
+  if (directory == nullptr) return 0;
+  while (struct dirent* entry = readdir(directory)) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..") continue;
+    count += run_path(path + "/" + name);
+  }
+  closedir(directory);
+  return count;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t count = 0;
+  for (int i = 1; i < argc; i++) count += run_path(argv[i]);
+  printf("Ran %zu inputs\n", count);
+  return 0;
+}
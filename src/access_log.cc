@@ -0,0 +1,167 @@
+#include "access_log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "http_message.h"
+
+namespace simple_http_server {
+
+namespace {
+
+// Records moved out of the rings at once, and the size of formatted output
+// that triggers a write
+constexpr size_t kFlushBatchSize = 256;
+constexpr size_t kWriteBufferSize = 1 << 16;
+
+void append_json_string(const char* data, size_t length, std::string* out) {
+  out->push_back('"');
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = data[i];
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out->append(escaped);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+void append_json_line(const AccessLogRecord& record, std::string* out) {
+  char fields[256];
+  snprintf(fields, sizeof(fields),
+           "{\"ts\":%lld,\"fd\":%d,\"method\":\"%s\",\"path_hash\":\"%016llx\","
+           "\"status\":%u,\"bytes\":%llu,\"latency_us\":%u,\"path\":",
+           static_cast<long long>(record.timestamp_ns), record.fd,
+           to_string(static_cast<HttpMethod>(record.method)).c_str(),
+           static_cast<unsigned long long>(record.path_hash), record.status,
+           static_cast<unsigned long long>(record.bytes), record.latency_us);
+  out->append(fields);
+  append_json_string(record.path, record.path_length, out);
+  out->append("}\n");
+}
+
+}  // namespace
+
+std::uint64_t fnv1a_hash(const char* data, size_t length) {
+  std::uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+AccessLog::AccessLog(const std::string& path, size_t producer_count,
+                     const AccessLogOptions& options)
+    : fd_(-1),
+      format_(options.format),
+      sample_rate_(options.sample_rate > 0 ? options.sample_rate : 1),
+      flush_interval_(options.flush_interval),
+      running_(false) {
+  for (size_t i = 0; i < producer_count; i++) {
+    producers_.emplace_back(new Producer(options.ring_capacity));
+  }
+  // O_APPEND keeps each batch contiguous even if other processes share the
+  // file, since every write lands at the end atomically
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Failed to open access log " + path);
+  }
+}
+
+AccessLog::~AccessLog() {
+  Stop();
+  close(fd_);
+}
+
+void AccessLog::Start() {
+  if (running_) return;
+  running_ = true;
+  writer_thread_ = std::thread(&AccessLog::Run, this);
+}
+
+void AccessLog::Stop() {
+  if (running_) {
+    running_ = false;
+    writer_thread_.join();
+  }
+  Flush();
+}
+
+std::uint64_t AccessLog::dropped() const {
+  std::uint64_t total = 0;
+  for (const auto& producer : producers_) {
+    total += producer->dropped.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void AccessLog::Run() {
+  while (running_) {
+    Flush();
+    std::this_thread::sleep_for(flush_interval_);
+  }
+}
+
+void AccessLog::Flush() {
+  std::string out;
+
+  out.reserve(kWriteBufferSize + kFlushBatchSize * sizeof(AccessLogRecord));
+  for (auto& producer : producers_) {
+    Drain(producer.get(), &out);
+  }
+  if (!out.empty()) Write(out.data(), out.size());
+}
+
+void AccessLog::Flush(size_t producer) {
+  std::string out;
+
+  out.reserve(kWriteBufferSize + kFlushBatchSize * sizeof(AccessLogRecord));
+  Drain(producers_[producer].get(), &out);
+  if (!out.empty()) Write(out.data(), out.size());
+}
+
+void AccessLog::Drain(Producer* producer, std::string* out) {
+  AccessLogRecord records[kFlushBatchSize];
+  size_t n;
+
+  while ((n = producer->ring.Pop(records, kFlushBatchSize)) > 0) {
+    if (format_ == AccessLogFormat::kBinary) {
+      out->append(reinterpret_cast<const char*>(records),
+                  n * sizeof(AccessLogRecord));
+    } else {
+      for (size_t i = 0; i < n; i++) append_json_line(records[i], out);
+    }
+    if (out->size() >= kWriteBufferSize) {
+      Write(out->data(), out->size());
+      out->clear();
+    }
+  }
+}
+
+void AccessLog::Write(const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t byte_count = write(fd_, data, length);
+    if (byte_count < 0) {
+      if (errno == EINTR) continue;
+      return;  // the log is best effort, losing it must not stop the server
+    }
+    data += byte_count;
+    length -= byte_count;
+  }
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,163 @@
+// Defines the access log, which records every request without slowing down
+// the workers: each worker appends fixed-size records to its own lock-free
+// ring buffer, and a background thread writes them to the log file in batches
+
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace simple_http_server {
+
+// Longest path prefix kept in a record, the hash covers the whole path
+constexpr size_t kAccessLogPathLength = 92;
+
+// One request in the access log. It is written as is in the binary format.
+struct AccessLogRecord {
+  std::int64_t timestamp_ns;  // wall clock time the request was read
+  std::uint64_t path_hash;    // FNV-1a hash of the full path
+  std::uint64_t bytes;        // size of the response
+  std::uint32_t latency_us;   // from reading the request to sending the response
+  std::int32_t fd;
+  std::uint16_t status;
+  std::uint8_t method;  // an HttpMethod
+  std::uint8_t path_length;
+  char path[kAccessLogPathLength];
+};
+static_assert(sizeof(AccessLogRecord) == 128,
+              "Access log records should fill two cache lines");
+
+std::uint64_t fnv1a_hash(const char* data, size_t length);
+
+// A bounded queue with a single producer and a single consumer, which only
+// synchronize through the head and tail indices. The capacity is rounded up
+// to a power of two.
+template <typename T>
+class SpscRing {
+ public:
+  explicit SpscRing(size_t capacity)
+      : mask_(RoundUpToPowerOfTwo(capacity) - 1),
+        items_(new T[mask_ + 1]),
+        head_(0),
+        tail_(0) {}
+  ~SpscRing() = default;
+
+  // Called by the producer only. Returns false when the ring is full.
+  bool TryPush(const T& item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) return false;
+    items_[tail & mask_] = item;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called by the consumer only. Moves up to `max_items` items to `out`
+  // and returns how many were moved.
+  size_t Pop(T* out, size_t max_items) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t available = tail_.load(std::memory_order_acquire) - head;
+    size_t n = available < max_items ? available : max_items;
+    for (size_t i = 0; i < n; i++) {
+      out[i] = items_[(head + i) & mask_];
+    }
+    head_.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+ private:
+  static size_t RoundUpToPowerOfTwo(size_t n) {
+    if (n == 0) throw std::invalid_argument("Ring capacity must be positive");
+    size_t power = 1;
+    while (power < n) power <<= 1;
+    return power;
+  }
+
+  const size_t mask_;
+  std::unique_ptr<T[]> items_;
+  // producer and consumer indices on separate cache lines
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+};
+
+enum class AccessLogFormat { kJsonLines, kBinary };
+
+struct AccessLogOptions {
+  AccessLogOptions()
+      : format(AccessLogFormat::kJsonLines),
+        ring_capacity(8192),
+        sample_rate(1),
+        flush_interval(100) {}
+  AccessLogFormat format;
+  // Records each worker can buffer before new ones are dropped
+  size_t ring_capacity;
+  // Only one request out of `sample_rate` is logged
+  std::uint32_t sample_rate;
+  // How often the background thread writes buffered records
+  std::chrono::milliseconds flush_interval;
+};
+
+// Writes access log records from several producers, one per ring, to a file
+class AccessLog {
+ public:
+  AccessLog(const std::string& path, size_t producer_count,
+            const AccessLogOptions& options);
+  ~AccessLog();
+
+  // Starts the background thread that writes the records
+  void Start();
+  // Stops the background thread if it runs, then writes the records still
+  // buffered
+  void Stop();
+  // Writes the records buffered by `producer`. A log that is not started
+  // relies on its producers calling this every flush_interval() instead.
+  void Flush(size_t producer);
+  std::chrono::milliseconds flush_interval() const { return flush_interval_; }
+
+  // Called by producer `producer` for every request, never blocks
+  void Log(size_t producer, const AccessLogRecord& record) {
+    Producer& p = *producers_[producer];
+    if (sample_rate_ > 1 && p.sample_counter++ % sample_rate_ != 0) return;
+    if (!p.ring.TryPush(record)) {
+      p.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  // Number of records lost because a ring was full
+  std::uint64_t dropped() const;
+
+ private:
+  struct Producer {
+    explicit Producer(size_t capacity)
+        : ring(capacity), sample_counter(0), dropped(0) {}
+    SpscRing<AccessLogRecord> ring;
+    std::uint32_t sample_counter;
+    std::atomic<std::uint64_t> dropped;
+  };
+
+  int fd_;
+  AccessLogFormat format_;
+  std::uint32_t sample_rate_;
+  std::chrono::milliseconds flush_interval_;
+  std::vector<std::unique_ptr<Producer>> producers_;
+  std::atomic<bool> running_;
+  std::thread writer_thread_;
+
+  void Run();
+  // Drains every ring and writes the records in one system call per batch
+  void Flush();
+  // Moves the records of `producer` to `out`, writing it whenever it fills
+  void Drain(Producer* producer, std::string* out);
+  void Write(const char* data, size_t length);
+};
+
+}  // namespace simple_http_server
+
+#endif  // ACCESS_LOG_H_
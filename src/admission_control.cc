@@ -0,0 +1,109 @@
+#include "admission_control.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+
+namespace simple_http_server {
+
+TokenBucket::TokenBucket(double rate, size_t burst)
+    : interval_(0), tolerance_(0), arrival_time_(0) {
+  if (rate <= 0 || burst == 0) {
+    throw std::invalid_argument("Rate limit must be positive");
+  }
+  interval_ = static_cast<std::int64_t>(1e9 / rate);
+  tolerance_ = interval_ * static_cast<std::int64_t>(burst - 1);
+}
+
+bool TokenBucket::TryAcquire(std::chrono::steady_clock::time_point now) {
+  std::int64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       now.time_since_epoch())
+                       .count();
+  std::int64_t arrival = arrival_time_.load(std::memory_order_relaxed);
+
+  do {
+    if (arrival - t > tolerance_) return false;  // ahead of the allowed rate
+  } while (!arrival_time_.compare_exchange_weak(
+      arrival, std::max(arrival, t) + interval_, std::memory_order_relaxed));
+  return true;
+}
+
+ClientKey client_key(const sockaddr_storage& address) {
+  if (address.ss_family == AF_INET) {
+    return ntohl(((const sockaddr_in&)address).sin_addr.s_addr);
+  }
+  if (address.ss_family != AF_INET6) return kUnknownClient;
+
+  const std::uint8_t* bytes = ((const sockaddr_in6&)address).sin6_addr.s6_addr;
+  if (IN6_IS_ADDR_V4MAPPED(&((const sockaddr_in6&)address).sin6_addr)) {
+    // an IPv4 client of a dual-stack socket
+    return (ClientKey(bytes[12]) << 24) | (ClientKey(bytes[13]) << 16) |
+           (ClientKey(bytes[14]) << 8) | ClientKey(bytes[15]);
+  }
+  ClientKey prefix = 0;
+  for (int i = 0; i < 8; i++) prefix = (prefix << 8) | bytes[i];
+  // keep IPv6 prefixes apart from IPv4 addresses
+  return prefix | (ClientKey(1) << 63);
+}
+
+bool ClientConnectionTable::TryAcquire(ClientKey key, size_t limit) {
+  Shard& s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  size_t& count = s.counts[key];
+  if (count >= limit) {
+    if (count == 0) s.counts.erase(key);
+    return false;
+  }
+  count++;
+  return true;
+}
+
+void ClientConnectionTable::Release(ClientKey key) {
+  Shard& s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto it = s.counts.find(key);
+  if (it == s.counts.end()) return;
+  if (--it->second == 0) s.counts.erase(it);
+}
+
+size_t ClientConnectionTable::count(ClientKey key) {
+  Shard& s = shard(key);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto it = s.counts.find(key);
+  return it == s.counts.end() ? 0 : it->second;
+}
+
+HttpStatusCode AdmissionController::AdmitConnection(ClientKey key) {
+  size_t count = connection_count_.fetch_add(1, std::memory_order_relaxed);
+  if (policy_.max_connections > 0 && count >= policy_.max_connections) {
+    connection_count_.fetch_sub(1, std::memory_order_relaxed);
+    return HttpStatusCode::ServiceUnvailable;
+  }
+  if (policy_.max_connections_per_client > 0 && key != kUnknownClient &&
+      !client_connections_.TryAcquire(key,
+                                      policy_.max_connections_per_client)) {
+    connection_count_.fetch_sub(1, std::memory_order_relaxed);
+    return HttpStatusCode::TooManyRequests;
+  }
+  return HttpStatusCode::Ok;
+}
+
+void AdmissionController::ReleaseConnection(ClientKey key) {
+  connection_count_.fetch_sub(1, std::memory_order_relaxed);
+  if (policy_.max_connections_per_client > 0 && key != kUnknownClient) {
+    client_connections_.Release(key);
+  }
+}
+
+bool AdmissionController::AdmitRequest(const Uri& uri) {
+  if (route_limits_.empty()) return true;
+  auto it = route_limits_.find(uri);
+  return it == route_limits_.end() || it->second->TryAcquire();
+}
+
+}  // namespace simple_http_server
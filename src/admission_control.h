@@ -0,0 +1,126 @@
+// Defines the admission control used by the server to protect itself from
+// overload: connection limits, per-client limits and per-route rate limits
+
+#ifndef ADMISSION_CONTROL_H_
+#define ADMISSION_CONTROL_H_
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "http_message.h"
+#include "uri.h"
+
+namespace simple_http_server {
+
+// Limits applied to new connections and requests. A limit of 0 disables the
+// corresponding check.
+struct AdmissionPolicy {
+  AdmissionPolicy()
+      : max_connections(0), max_connections_per_client(0), max_queue_depth(0) {}
+  // Concurrent connections accepted by the server
+  size_t max_connections;
+  // Concurrent connections from the same client address
+  size_t max_connections_per_client;
+  // Number of ready events a worker can have in one epoll_wait before it
+  // sheds new requests with 503
+  size_t max_queue_depth;
+};
+
+// A rate limiter that allows `rate` requests per second on average with
+// bursts of up to `burst` requests. It is implemented with the generic cell
+// rate algorithm, whose whole state is the theoretical arrival time of the
+// next request, so it only needs a single atomic variable.
+class TokenBucket {
+ public:
+  TokenBucket(double rate, size_t burst);
+  ~TokenBucket() = default;
+
+  bool TryAcquire(std::chrono::steady_clock::time_point now =
+                      std::chrono::steady_clock::now());
+
+ private:
+  std::int64_t interval_;   // nanoseconds between two requests
+  std::int64_t tolerance_;  // how far ahead of schedule a burst can go
+  std::atomic<std::int64_t> arrival_time_;
+};
+
+// Identifies a client for per-client limits: the IPv4 address, or the /64
+// prefix of an IPv6 address since a single host usually owns a whole /64.
+// Clients without an IP address, such as those connected over a Unix domain
+// socket, all get kUnknownClient and are not subject to per-client limits.
+using ClientKey = std::uint64_t;
+constexpr ClientKey kUnknownClient = 0;
+ClientKey client_key(const sockaddr_storage& address);
+
+// Counts concurrent connections per client in a hash table split into
+// shards, each with its own lock, so that concurrent accepts and closes of
+// different clients rarely contend
+class ClientConnectionTable {
+ public:
+  ClientConnectionTable() = default;
+  ~ClientConnectionTable() = default;
+
+  // Increments the count of the client unless it already reached the limit
+  bool TryAcquire(ClientKey key, size_t limit);
+  void Release(ClientKey key);
+  size_t count(ClientKey key);
+
+ private:
+  static constexpr size_t kShardCount = 64;
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::unordered_map<ClientKey, size_t> counts;
+  };
+
+  Shard shards_[kShardCount];
+
+  Shard& shard(ClientKey key) {
+    // mix the bits since consecutive addresses differ in the low bits only
+    return shards_[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+  }
+};
+
+// Decides whether connections and requests are admitted. The policy and the
+// route limits must be configured before the server starts; the checks are
+// then safe to call from any thread.
+class AdmissionController {
+ public:
+  AdmissionController() : connection_count_(0) {}
+  ~AdmissionController() = default;
+
+  void SetPolicy(const AdmissionPolicy& policy) { policy_ = policy; }
+  void SetRouteRateLimit(const Uri& uri, double rate, size_t burst) {
+    route_limits_[uri].reset(new TokenBucket(rate, burst));
+  }
+
+  // Returns Ok when the connection is admitted, otherwise the status code
+  // of the response to reject it with
+  HttpStatusCode AdmitConnection(ClientKey key);
+  void ReleaseConnection(ClientKey key);
+  bool AdmitRequest(const Uri& uri);
+  bool Overloaded(size_t queue_depth) const {
+    return policy_.max_queue_depth > 0 && queue_depth > policy_.max_queue_depth;
+  }
+
+  const AdmissionPolicy& policy() const { return policy_; }
+  size_t connection_count() const { return connection_count_; }
+
+ private:
+  AdmissionPolicy policy_;
+  std::atomic<size_t> connection_count_;
+  ClientConnectionTable client_connections_;
+  std::map<Uri, std::unique_ptr<TokenBucket>> route_limits_;
+};
+
+}  // namespace simple_http_server
+
+#endif  // ADMISSION_CONTROL_H_
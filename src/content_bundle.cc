@@ -0,0 +1,343 @@
+#include "content_bundle.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace simple_http_server {
+
+namespace {
+
+// Seeds tried for a bucket before giving up on the perfect hash
+constexpr std::uint32_t kMaxBucketSeed = 1 << 24;
+
+// Average number of keys per perfect hash bucket
+constexpr size_t kKeysPerBucket = 4;
+
+std::string trim(const std::string& s) {
+  size_t first = s.find_first_not_of(" \t");
+  if (first == std::string::npos) return std::string();
+  return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+}
+
+bool equals_ignore_case(const std::string& a, const std::string& b) {
+  return a.length() == b.length() &&
+         std::equal(a.begin(), a.end(), b.begin(),
+                    [](unsigned char x, unsigned char y) {
+                      return tolower(x) == tolower(y);
+                    });
+}
+
+std::string quoted_hash(const std::string& content, const char* suffix) {
+  char etag[32];
+  snprintf(etag, sizeof(etag), "\"%016llx%s\"",
+           static_cast<unsigned long long>(
+               bundle_hash(content.data(), content.length(), 0)),
+           suffix);
+  return etag;
+}
+
+// Accumulates the bytes the entries point to
+class BlobWriter {
+ public:
+  explicit BlobWriter(std::uint64_t base) : base_(base) {}
+
+  BundleBlob Add(const std::string& bytes) {
+    BundleBlob blob = {base_ + data_.length(), bytes.length()};
+    data_.append(bytes);
+    return blob;
+  }
+  const std::string& data() const { return data_; }
+
+ private:
+  std::uint64_t base_;
+  std::string data_;
+};
+
+BundleVariant add_variant(const std::string& content_type,
+                          const std::string& content, bool gzip,
+                          bool has_gzip, BlobWriter* blobs) {
+  BundleVariant variant;
+  std::string etag = quoted_hash(content, gzip ? "-gzip" : "");
+  std::string common = "ETag: " + etag + "\r\n";
+  if (has_gzip) common += "Vary: Accept-Encoding\r\n";
+
+  std::string headers = "HTTP/1.1 200 OK\r\nContent-Type: " + content_type +
+                        "\r\nContent-Length: " +
+                        std::to_string(content.length()) + "\r\n" + common;
+  if (gzip) headers += "Content-Encoding: gzip\r\n";
+  variant.headers = blobs->Add(headers);
+  variant.not_modified_headers =
+      blobs->Add("HTTP/1.1 304 Not Modified\r\n" + common);
+  variant.body = blobs->Add(content);
+  variant.etag = blobs->Add(etag);
+  return variant;
+}
+
+bool blob_in_range(const BundleBlob& blob, size_t length) {
+  return blob.offset <= length && blob.length <= length - blob.offset;
+}
+
+bool variant_in_range(const BundleVariant& variant, size_t length) {
+  return blob_in_range(variant.headers, length) &&
+         blob_in_range(variant.not_modified_headers, length) &&
+         blob_in_range(variant.body, length) &&
+         blob_in_range(variant.etag, length);
+}
+
+}  // namespace
+
+std::uint64_t bundle_hash(const char* data, size_t length,
+                          std::uint32_t seed) {
+  std::uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+  for (size_t i = 0; i < length; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  // FNV-1a mixes the last bytes poorly, which the murmur3 finalizer fixes
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+bool accepts_gzip(const std::string& accept_encoding) {
+  size_t start = 0;
+
+  // coding [ ";" "q=" qvalue ] ("," coding [ ";" "q=" qvalue ])*
+  while (start <= accept_encoding.length()) {
+    size_t end = accept_encoding.find(',', start);
+    if (end == std::string::npos) end = accept_encoding.length();
+    std::string item = accept_encoding.substr(start, end - start);
+    size_t semicolon = item.find(';');
+    if (equals_ignore_case(trim(item.substr(0, semicolon)), "gzip")) {
+      if (semicolon == std::string::npos) return true;
+      std::string parameter = trim(item.substr(semicolon + 1));
+      if (parameter.length() < 2 ||
+          tolower(static_cast<unsigned char>(parameter[0])) != 'q' ||
+          parameter[1] != '=') {
+        return true;
+      }
+      return strtod(parameter.c_str() + 2, nullptr) > 0;
+    }
+    start = end + 1;
+  }
+  return false;
+}
+
+void pack_content_bundle(const std::vector<BundleFile>& files,
+                         const std::string& output) {
+  std::vector<std::pair<std::string, size_t>> keys;  // path, file
+  std::set<std::string> paths;
+  for (size_t i = 0; i < files.size(); i++) {
+    for (const auto& path : files[i].paths) {
+      if (!paths.insert(path).second) {
+        throw std::invalid_argument("Duplicate path in content bundle: " +
+                                    path);
+      }
+      keys.emplace_back(path, i);
+    }
+  }
+
+  // Hash and displace: the keys are spread into buckets, and the keys of
+  // each bucket are placed with the first seed that sends all of them to
+  // free slots. The largest buckets go first, while most slots are free.
+  size_t n = keys.size();
+  std::uint32_t bucket_count =
+      std::max<std::uint32_t>(1, (n + kKeysPerBucket - 1) / kKeysPerBucket);
+  std::vector<std::vector<size_t>> buckets(bucket_count);
+  for (size_t k = 0; k < n; k++) {
+    const std::string& path = keys[k].first;
+    buckets[bundle_hash(path.data(), path.length(), 0) % bucket_count]
+        .push_back(k);
+  }
+  std::vector<std::uint32_t> order(bucket_count);
+  for (std::uint32_t b = 0; b < bucket_count; b++) order[b] = b;
+  std::stable_sort(order.begin(), order.end(),
+                   [&](std::uint32_t a, std::uint32_t b) {
+                     return buckets[a].size() > buckets[b].size();
+                   });
+
+  std::vector<std::uint32_t> seeds(bucket_count, 0);
+  std::vector<size_t> slot_keys(n, n);  // n marks a free slot
+  std::vector<size_t> slots;
+  for (std::uint32_t b : order) {
+    if (buckets[b].empty()) break;
+    for (std::uint32_t seed = 1;; seed++) {
+      if (seed == kMaxBucketSeed) {
+        throw std::runtime_error("Failed to build the content bundle index");
+      }
+      slots.clear();
+      for (size_t k : buckets[b]) {
+        const std::string& path = keys[k].first;
+        size_t slot = bundle_hash(path.data(), path.length(), seed) % n;
+        if (slot_keys[slot] != n ||
+            std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+          break;
+        }
+        slots.push_back(slot);
+      }
+      if (slots.size() < buckets[b].size()) continue;
+      for (size_t i = 0; i < slots.size(); i++) {
+        slot_keys[slots[i]] = buckets[b][i];
+      }
+      seeds[b] = seed;
+      break;
+    }
+  }
+
+  BundleHeader header = {};
+  memcpy(header.magic, kContentBundleMagic, sizeof(header.magic));
+  header.version = kContentBundleVersion;
+  header.entry_count = n;
+  header.bucket_count = bucket_count;
+  header.buckets_offset = sizeof(BundleHeader);
+  header.entries_offset = header.buckets_offset +
+                          (bucket_count * sizeof(std::uint32_t) + 7) / 8 * 8;
+
+  // the entries of all the paths of a file share its blobs
+  BlobWriter blobs(header.entries_offset + n * sizeof(BundleEntry));
+  std::vector<BundleEntry> file_entries(files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    const BundleFile& file = files[i];
+    bool has_gzip = !file.gzip_content.empty();
+    BundleEntry& entry = file_entries[i];
+    entry = BundleEntry();
+    entry.identity = add_variant(file.content_type, file.content, false,
+                                 has_gzip, &blobs);
+    if (has_gzip) {
+      entry.gzip = add_variant(file.content_type, file.gzip_content, true,
+                               has_gzip, &blobs);
+    }
+  }
+  std::vector<BundleEntry> entries(n);
+  for (size_t slot = 0; slot < n; slot++) {
+    const auto& key = keys[slot_keys[slot]];
+    entries[slot] = file_entries[key.second];
+    entries[slot].path = blobs.Add(key.first);
+  }
+
+  // a server may have the previous bundle mapped, so it is replaced rather
+  // than overwritten
+  std::string temporary = output + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    std::string padding(header.entries_offset - header.buckets_offset -
+                            bucket_count * sizeof(std::uint32_t),
+                        '\0');
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(seeds.data()),
+              bucket_count * sizeof(std::uint32_t));
+    out.write(padding.data(), padding.length());
+    out.write(reinterpret_cast<const char*>(entries.data()),
+              n * sizeof(BundleEntry));
+    out.write(blobs.data().data(), blobs.data().length());
+    if (!out.flush()) {
+      unlink(temporary.c_str());
+      throw std::runtime_error("Failed to write content bundle " + output);
+    }
+  }
+  if (rename(temporary.c_str(), output.c_str()) < 0) {
+    unlink(temporary.c_str());
+    throw std::runtime_error("Failed to write content bundle " + output);
+  }
+}
+
+ContentBundle::ContentBundle(const std::string& path)
+    : base_(nullptr),
+      length_(0),
+      header_(nullptr),
+      buckets_(nullptr),
+      entries_(nullptr) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open content bundle " + path);
+  }
+  struct stat status;
+  if (fstat(fd, &status) < 0 ||
+      static_cast<size_t>(status.st_size) < sizeof(BundleHeader)) {
+    close(fd);
+    throw std::runtime_error("Invalid content bundle " + path);
+  }
+  // the mapping outlives the file descriptor
+  void* memory =
+      mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Failed to map content bundle " + path);
+  }
+
+  base_ = static_cast<const char*>(memory);
+  length_ = status.st_size;
+  header_ = reinterpret_cast<const BundleHeader*>(base_);
+  if (!Validate()) {
+    munmap(memory, length_);
+    throw std::runtime_error("Invalid content bundle " + path);
+  }
+  buckets_ = reinterpret_cast<const std::uint32_t*>(base_ +
+                                                    header_->buckets_offset);
+  entries_ =
+      reinterpret_cast<const BundleEntry*>(base_ + header_->entries_offset);
+}
+
+ContentBundle::~ContentBundle() {
+  munmap(const_cast<char*>(base_), length_);
+}
+
+bool ContentBundle::Validate() const {
+  const BundleHeader& header = *header_;
+  if (memcmp(header.magic, kContentBundleMagic, sizeof(header.magic)) != 0 ||
+      header.version != kContentBundleVersion || header.bucket_count == 0 ||
+      header.buckets_offset % alignof(std::uint32_t) != 0 ||
+      header.entries_offset % alignof(BundleEntry) != 0) {
+    return false;
+  }
+  BundleBlob buckets = {header.buckets_offset,
+                        header.bucket_count * sizeof(std::uint32_t)};
+  BundleBlob entries = {header.entries_offset,
+                        header.entry_count * sizeof(BundleEntry)};
+  if (!blob_in_range(buckets, length_) || !blob_in_range(entries, length_)) {
+    return false;
+  }
+  const BundleEntry* entry =
+      reinterpret_cast<const BundleEntry*>(base_ + header.entries_offset);
+  for (std::uint32_t i = 0; i < header.entry_count; i++, entry++) {
+    if (!blob_in_range(entry->path, length_) ||
+        !variant_in_range(entry->identity, length_) ||
+        !variant_in_range(entry->gzip, length_)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const BundleEntry* ContentBundle::Find(const char* path,
+                                       size_t length) const {
+  if (header_->entry_count == 0) return nullptr;
+  std::uint32_t seed =
+      buckets_[bundle_hash(path, length, 0) % header_->bucket_count];
+  const BundleEntry& entry =
+      entries_[bundle_hash(path, length, seed) % header_->entry_count];
+  // a path that is not in the bundle still lands on some slot
+  if (entry.path.length != length ||
+      memcmp(data(entry.path), path, length) != 0) {
+    return nullptr;
+  }
+  return &entry;
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,110 @@
+// Defines content bundles: a set of static files packed into one read-only
+// file, together with their response headers, ETags and optional gzip
+// variants. The server maps a bundle into memory at startup and sends its
+// files straight from the mapped pages, without reading or copying them.
+
+#ifndef CONTENT_BUNDLE_H_
+#define CONTENT_BUNDLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace simple_http_server {
+
+constexpr char kContentBundleMagic[8] = {'S', 'H', 'S', 'B',
+                                         'U', 'N', 'D', 'L'};
+constexpr std::uint32_t kContentBundleVersion = 1;
+
+// The file format, in the byte order of the machine that packed it:
+// a BundleHeader, the displacement of each perfect hash bucket, the entries
+// in the order of their hash slots, then the bytes the entries point to.
+struct BundleHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t entry_count;
+  std::uint32_t bucket_count;
+  std::uint32_t reserved;
+  std::uint64_t buckets_offset;
+  std::uint64_t entries_offset;
+};
+
+// A range of bytes of the bundle
+struct BundleBlob {
+  std::uint64_t offset;
+  std::uint64_t length;
+};
+
+// One representation of a file. The headers start with the status line and
+// end with the last header field, without the empty line.
+struct BundleVariant {
+  BundleBlob headers;
+  BundleBlob not_modified_headers;  // the 304 response
+  BundleBlob body;
+  BundleBlob etag;  // quoted
+};
+
+struct BundleEntry {
+  BundleBlob path;
+  BundleVariant identity;
+  BundleVariant gzip;  // empty when the file has no gzip variant
+};
+
+// Seeded 64-bit hash of the perfect hash function
+std::uint64_t bundle_hash(const char* data, size_t length, std::uint32_t seed);
+
+// Whether an Accept-Encoding header value allows a gzip response
+bool accepts_gzip(const std::string& accept_encoding);
+
+// A file to pack. It is served under each of its paths, which must be
+// lowercase since the server lowercases request paths.
+struct BundleFile {
+  std::vector<std::string> paths;
+  std::string content_type;
+  std::string content;
+  std::string gzip_content;  // empty when there is no gzip variant
+};
+
+// Writes a bundle holding `files` to `output`. Throws std::invalid_argument
+// when a path appears twice, std::runtime_error when the file cannot be
+// written.
+void pack_content_bundle(const std::vector<BundleFile>& files,
+                         const std::string& output);
+
+// A bundle mapped into memory, which stays valid and read-only until the
+// object is destroyed
+class ContentBundle {
+ public:
+  // Throws std::runtime_error when the file cannot be mapped, or is not a
+  // valid bundle
+  explicit ContentBundle(const std::string& path);
+  ~ContentBundle();
+
+  ContentBundle(const ContentBundle&) = delete;
+  ContentBundle& operator=(const ContentBundle&) = delete;
+
+  // The entry served at `path`, or nullptr
+  const BundleEntry* Find(const char* path, size_t length) const;
+  const BundleEntry* Find(const std::string& path) const {
+    return Find(path.data(), path.length());
+  }
+  const char* data(const BundleBlob& blob) const {
+    return base_ + blob.offset;
+  }
+  size_t size() const { return header_->entry_count; }
+
+ private:
+  const char* base_;
+  size_t length_;
+  const BundleHeader* header_;
+  const std::uint32_t* buckets_;
+  const BundleEntry* entries_;
+
+  // Whether every table and blob lies within the file
+  bool Validate() const;
+};
+
+}  // namespace simple_http_server
+
+#endif  // CONTENT_BUNDLE_H_
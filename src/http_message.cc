@@ -56,6 +56,8 @@ std::string to_string(HttpStatusCode status_code) {
   switch (status_code) {
     case HttpStatusCode::Continue:
       return "Continue";
+    case HttpStatusCode::SwitchingProtocols:
+      return "Switching Protocols";
     case HttpStatusCode::Ok:
       return "OK";
     case HttpStatusCode::Accepted:
@@ -74,12 +76,18 @@ std::string to_string(HttpStatusCode status_code) {
       return "Method Not Allowed";
     case HttpStatusCode::ImATeapot:
       return "I'm a Teapot";
+    case HttpStatusCode::UpgradeRequired:
+      return "Upgrade Required";
+    case HttpStatusCode::TooManyRequests:
+      return "Too Many Requests";
     case HttpStatusCode::InternalServerError:
       return "Internal Server Error";
     case HttpStatusCode::NotImplemented:
       return "Not Implemented";
     case HttpStatusCode::BadGateway:
       return "Bad Gateway";
+    case HttpStatusCode::ServiceUnvailable:
+      return "Service Unavailable";
     default:
       return std::string();
   }
@@ -89,7 +97,7 @@ HttpMethod string_to_method(const std::string& method_string) {
   std::string method_string_uppercase;
   std::transform(method_string.begin(), method_string.end(),
                  std::back_inserter(method_string_uppercase),
-                 [](char c) { return toupper(c); });
+                 [](unsigned char c) { return toupper(c); });
   if (method_string_uppercase == "GET") {
     return HttpMethod::GET;
   } else if (method_string_uppercase == "HEAD") {
@@ -117,7 +125,7 @@ HttpVersion string_to_version(const std::string& version_string) {
   std::string version_string_uppercase;
   std::transform(version_string.begin(), version_string.end(),
                  std::back_inserter(version_string_uppercase),
-                 [](char c) { return toupper(c); });
+                 [](unsigned char c) { return toupper(c); });
   if (version_string_uppercase == "HTTP/0.9") {
     return HttpVersion::HTTP_0_9;
   } else if (version_string_uppercase == "HTTP/1.0") {
@@ -160,6 +168,16 @@ std::string to_string(const HttpResponse& response, bool send_content) {
   return oss.str();
 }
 
+namespace {
+
+// Unlike std::isspace, safe for any char and independent of the locale
+bool is_whitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' ||
+         c == '\f';
+}
+
+}  // namespace
+
 HttpRequest string_to_request(const std::string& request_string) {
   std::string start_line, header_lines, message_body;
   std::istringstream iss;
@@ -176,14 +194,14 @@ HttpRequest string_to_request(const std::string& request_string) {
 
   start_line = request_string.substr(lpos, rpos - lpos);
   lpos = rpos + 2;
-  rpos = request_string.find("\r\n\r\n", lpos);
-  if (rpos != std::string::npos) {  // has header
-    header_lines = request_string.substr(lpos, rpos - lpos);
-    lpos = rpos + 4;
-    rpos = request_string.length();
-    if (lpos < rpos) {
-      message_body = request_string.substr(lpos, rpos - lpos);
+  // the empty line may directly follow the start line when there is no
+  // header, so it is searched from the end of the start line
+  rpos = request_string.find("\r\n\r\n", rpos);
+  if (rpos != std::string::npos) {
+    if (rpos >= lpos) {  // has header
+      header_lines = request_string.substr(lpos, rpos - lpos);
     }
+    message_body = request_string.substr(rpos + 4);
   }
 
   iss.clear();  // parse the start line
@@ -194,24 +212,33 @@ HttpRequest string_to_request(const std::string& request_string) {
   }
   request.SetMethod(string_to_method(method));
   request.SetUri(Uri(path));
-  if (string_to_version(version) != request.version()) {
+  request.SetVersion(string_to_version(version));
+  if (request.version() != HttpVersion::HTTP_1_0 &&
+      request.version() != HttpVersion::HTTP_1_1) {
     throw std::logic_error("HTTP version not supported");
   }
 
   iss.clear();  // parse header fields
   iss.str(header_lines);
   while (std::getline(iss, line)) {
-    std::istringstream header_stream(line);
-    std::getline(header_stream, key, ':');
-    std::getline(header_stream, value);
-
-    // remove whitespaces from the two strings
-    key.erase(std::remove_if(key.begin(), key.end(),
-                             [](char c) { return std::isspace(c); }),
-              key.end());
-    value.erase(std::remove_if(value.begin(), value.end(),
-                               [](char c) { return std::isspace(c); }),
-                value.end());
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      throw std::invalid_argument("Invalid header field");
+    }
+    key = line.substr(0, colon);
+    value = line.substr(colon + 1);
+
+    // The name is followed by the colon right away (RFC 7230, section 3.2.4).
+    // Only the whitespace around the value is removed, the value itself may
+    // contain spaces, as in User-Agent.
+    if (key.empty() ||
+        std::find_if(key.begin(), key.end(), is_whitespace) != key.end()) {
+      throw std::invalid_argument("Invalid header field name");
+    }
+    auto first = std::find_if_not(value.begin(), value.end(), is_whitespace);
+    auto last = std::find_if_not(value.rbegin(), value.rend(), is_whitespace);
+    value = first < last.base() ? std::string(first, last.base())
+                                : std::string();
     request.SetHeader(key, value);
   }
 
@@ -224,4 +251,32 @@ HttpResponse string_to_response(const std::string& response_string) {
   throw std::logic_error("Method not implemented");
 }
 
+bool is_persistent_connection(const HttpRequest& request) {
+  std::string connection = request.header("Connection");
+
+  if (has_header_token(connection, "close")) return false;
+  if (request.version() == HttpVersion::HTTP_1_0) {
+    return has_header_token(connection, "keep-alive");
+  }
+  return true;
+}
+
+bool has_header_token(const std::string& value, const std::string& token) {
+  std::istringstream iss(value);
+  std::string item;
+
+  while (std::getline(iss, item, ',')) {
+    item.erase(std::remove_if(item.begin(), item.end(), is_whitespace),
+               item.end());
+    if (item.length() == token.length() &&
+        std::equal(item.begin(), item.end(), token.begin(),
+                   [](unsigned char a, unsigned char b) {
+                     return tolower(a) == tolower(b);
+                   })) {
+      return true;
+    }
+  }
+  return false;
+}
+
 }  // namespace simple_http_server
@@ -4,6 +4,8 @@
 #ifndef HTTP_MESSAGE_H_
 #define HTTP_MESSAGE_H_
 
+#include <algorithm>
+#include <cctype>
 #include <map>
 #include <string>
 #include <utility>
@@ -26,7 +28,7 @@ enum class HttpMethod {
   PATCH
 };
 
-// Here we only support HTTP/1.1
+// Here we only support HTTP/1.0 and HTTP/1.1
 enum class HttpVersion {
   HTTP_0_9 = 9,
   HTTP_1_0 = 10,
@@ -59,6 +61,8 @@ enum class HttpStatusCode {
   MethodNotAllowed = 405,
   RequestTimeout = 408,
   ImATeapot = 418,
+  UpgradeRequired = 426,
+  TooManyRequests = 429,
   InternalServerError = 500,
   NotImplemented = 501,
   BadGateway = 502,
@@ -67,6 +71,19 @@ enum class HttpStatusCode {
   HttpVersionNotSupported = 505
 };
 
+// Header field names are case-insensitive (RFC 7230, section 3.2)
+struct CaseInsensitiveLess {
+  bool operator()(const std::string& lhs, const std::string& rhs) const {
+    return std::lexicographical_compare(
+        lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+        [](unsigned char a, unsigned char b) {
+          return tolower(a) < tolower(b);
+        });
+  }
+};
+
+using HttpHeaders = std::map<std::string, std::string, CaseInsensitiveLess>;
+
 // Utility functions to convert between string or integer to enum classes
 std::string to_string(HttpMethod method);
 std::string to_string(HttpVersion version);
@@ -82,6 +99,7 @@ class HttpMessageInterface {
   HttpMessageInterface() : version_(HttpVersion::HTTP_1_1) {}
   virtual ~HttpMessageInterface() = default;
 
+  void SetVersion(HttpVersion version) { version_ = version; }
   void SetHeader(const std::string& key, const std::string& value) {
     headers_[key] = std::move(value);
   }
@@ -101,13 +119,13 @@ class HttpMessageInterface {
     if (headers_.count(key) > 0) return headers_.at(key);
     return std::string();
   }
-  std::map<std::string, std::string> headers() const { return headers_; }
+  HttpHeaders headers() const { return headers_; }
   std::string content() const { return content_; }
   size_t content_length() const { return content_.length(); }
 
  protected:
   HttpVersion version_;
-  std::map<std::string, std::string> headers_;
+  HttpHeaders headers_;
   std::string content_;
 
   void SetContentLength() {
@@ -163,6 +181,15 @@ std::string to_string(const HttpResponse& response, bool send_content = true);
 HttpRequest string_to_request(const std::string& request_string);
 HttpResponse string_to_response(const std::string& response_string);
 
+// Whether the connection should stay open after responding to this request.
+// HTTP/1.1 connections persist unless the client sends "Connection: close",
+// HTTP/1.0 connections only persist with "Connection: keep-alive"
+bool is_persistent_connection(const HttpRequest& request);
+
+// Whether a comma-separated header value, such as the one of Connection,
+// contains `token`. Tokens are compared case-insensitively.
+bool has_header_token(const std::string& value, const std::string& token);
+
 }  // namespace simple_http_server
 
 #endif  // HTTP_MESSAGE_H_
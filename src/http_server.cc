@@ -1,11 +1,15 @@
 #include "http_server.h"
 
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <cstring>
@@ -14,231 +18,989 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
+#include "admission_control.h"
+#include "content_bundle.h"
 #include "http_message.h"
+#include "listener.h"
+#include "listener_handoff.h"
+#include "tls.h"
+#include "trace.h"
 #include "uri.h"
+#include "websocket.h"
 
 namespace simple_http_server {
 
-HttpServer::HttpServer(const std::string &host, std::uint16_t port)
-    : host_(host),
-      port_(port),
-      sock_fd_(0),
+namespace {
+
+// Longest RunFor() blocks in epoll_wait, so that lingering connections
+// expire and idle ones migrate on time
+constexpr std::chrono::milliseconds kMaxPollWait(10);
+
+// What follows the header fields of a response from a content bundle
+const char kEndOfHeader[] = "\r\n";
+const char kEndOfHeaderClose[] = "Connection: close\r\n\r\n";
+const char kEndOfHeaderKeepAlive[] = "Connection: Keep-Alive\r\n\r\n";
+
+// The request forwarded to an upstream for the one received on `fd`, whose
+// raw bytes are `request_string`: the header section is rewritten, with the
+// client address added to X-Forwarded-For, and the body is kept as is
+std::string forwarded_request(int fd, const HttpRequest &request,
+                              const std::string &request_string) {
+  std::string fields;
+  sockaddr_storage address;
+  socklen_t address_len = sizeof(address);
+  char host[INET6_ADDRSTRLEN];
+  if (getpeername(fd, (sockaddr *)&address, &address_len) == 0) {
+    const void *ip = nullptr;
+    if (address.ss_family == AF_INET) {
+      ip = &((const sockaddr_in *)&address)->sin_addr;
+    } else if (address.ss_family == AF_INET6) {
+      ip = &((const sockaddr_in6 *)&address)->sin6_addr;
+    }
+    if (ip != nullptr &&
+        inet_ntop(address.ss_family, ip, host, sizeof(host)) != nullptr) {
+      fields += "X-Forwarded-For: " + std::string(host) + "\r\n";
+    }
+  }
+  // upstream connections are kept open whatever the client asked for
+  if (request.version() == HttpVersion::HTTP_1_0) {
+    fields += "Connection: keep-alive\r\n";
+  }
+
+  size_t end_of_header = request_string.find("\r\n\r\n");
+  if (end_of_header == std::string::npos) {
+    return rewrite_forwarded_header(request_string, fields);
+  }
+  return rewrite_forwarded_header(request_string.substr(0, end_of_header + 4),
+                                  fields) +
+         request_string.substr(end_of_header + 4);
+}
+
+// Sends what is left of the pieces of a response from a content bundle, in
+// a single system call unless OpenSSL encrypts the connection, and drops the
+// bytes that were sent from the pieces
+ssize_t send_segments(EventData *data, std::uint32_t *wait_events) {
+  iovec *segment = data->segments;
+  iovec *end = data->segments + data->segment_count;
+  while (segment->iov_len == 0) segment++;
+
+  // With kTLS the kernel encrypts what is written to the socket, so the
+  // pieces can still go out in one call
+  ssize_t byte_count;
+  if (data->tls != nullptr && !tls_kernel_send(data->tls)) {
+    byte_count =
+        tls_send(data->tls, segment->iov_base, segment->iov_len, wait_events);
+  } else {
+    msghdr message = {};
+    message.msg_iov = segment;
+    message.msg_iovlen = end - segment;
+    byte_count = sendmsg(data->fd, &message, MSG_NOSIGNAL);
+  }
+  for (size_t left = byte_count > 0 ? byte_count : 0; left > 0; segment++) {
+    size_t n = std::min(left, segment->iov_len);
+    segment->iov_base = static_cast<char *>(segment->iov_base) + n;
+    segment->iov_len -= n;
+    left -= n;
+  }
+  return byte_count;
+}
+
+}  // namespace
+
+HttpServer::HttpServer()
+    : worker_count_(kThreadPoolSize),
       running_(false),
+      draining_(false),
       worker_epoll_fd_(),
+      worker_wakeup_fd_(),
+      batched_pipeline_(false),
+      external_event_loop_(false),
+      metrics_(&own_metrics_),
+      broadcast_pending_(),
       rng_(std::chrono::steady_clock::now().time_since_epoch().count()),
       sleep_times_(10, 100) {
-  CreateSocket();
+#ifdef SIMPLE_HTTP_SERVER_TRACING
+  tracer_.reset(new Tracer(kThreadPoolSize, kTraceSpansPerWorker));
+#endif
 }
 
-void HttpServer::Start() {
-  int opt = 1;
-  sockaddr_in server_address;
+HttpServer::HttpServer(const std::string &host, std::uint16_t port)
+    : HttpServer() {
+  AddTcpListener(host, port);
+}
 
-  if (setsockopt(sock_fd_, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                 sizeof(opt)) < 0) {
-    throw std::runtime_error("Failed to set socket options");
+HttpServer::HttpServer(const std::vector<int> &listening_fds) : HttpServer() {
+  for (int fd : listening_fds) {
+    listeners_.emplace_back(fd);
   }
+}
 
-  server_address.sin_family = AF_INET;
-  server_address.sin_addr.s_addr = INADDR_ANY;
-  inet_pton(AF_INET, host_.c_str(), &(server_address.sin_addr.s_addr));
-  server_address.sin_port = htons(port_);
+void HttpServer::Configure(const HttpServerOptions &options) {
+  SetWorkerCount(options.workers);
+  SetDistributionOptions(options.distribution);
+  EnableBatchedPipeline(options.batched_pipeline);
+  external_event_loop_ = options.external_event_loop;
+}
 
-  if (bind(sock_fd_, (sockaddr *)&server_address, sizeof(server_address)) < 0) {
-    throw std::runtime_error("Failed to bind to socket");
+void HttpServer::SetWorkerCount(int count) {
+  if (count < 1 || count > kThreadPoolSize) {
+    throw std::invalid_argument("Invalid number of workers");
   }
+  worker_count_ = count;
+}
 
-  if (listen(sock_fd_, kBacklogSize) < 0) {
-    std::ostringstream msg;
-    msg << "Failed to listen on port " << port_;
-    throw std::runtime_error(msg.str());
-  }
+void HttpServer::Start() {
+  OpenListeners();
+  StartThreads();
+}
 
-  SetUpEpoll();
-  running_ = true;
-  listener_thread_ = std::thread(&HttpServer::Listen, this);
-  for (int i = 0; i < kThreadPoolSize; i++) {
-    worker_threads_[i] = std::thread(&HttpServer::ProcessEvents, this, i);
+void HttpServer::OpenListeners() {
+  if (listeners_.empty()) {
+    throw std::logic_error("The server has no listener");
+  }
+  try {
+    for (auto &listener : listeners_) {
+      if (!listener.inherited()) listener.Open();
+    }
+  } catch (const std::exception &e) {
+    for (auto &listener : listeners_) {
+      if (!listener.inherited()) listener.Close();
+    }
+    throw;
   }
 }
 
-void HttpServer::Stop() {
-  running_ = false;
-  listener_thread_.join();
-  for (int i = 0; i < kThreadPoolSize; i++) {
-    worker_threads_[i].join();
+void HttpServer::Stop(std::chrono::milliseconds drain_timeout) {
+  // the listener exits as soon as draining starts, workers keep serving
+  // their connections until all of them are closed or the deadline passes
+  drain_deadline_ = std::chrono::steady_clock::now() + drain_timeout;
+  draining_ = true;
+  if (external_event_loop_) {
+    // a listening socket handed off to another process stays open there,
+    // and would keep waking up the workers
+    for (int i = 0; i < worker_count_; i++) {
+      for (auto &listener : listeners_) {
+        if (listener.fd() >= 0) {
+          control_epoll_event(worker_epoll_fd_[i], EPOLL_CTL_DEL,
+                              listener.fd());
+        }
+      }
+    }
+  } else {
+    listener_thread_.join();
+  }
+  for (auto &listener : listeners_) {
+    listener.Close();
+  }
+  if (health_check_thread_.joinable()) health_check_thread_.join();
+  if (external_event_loop_) {
+    // the host no longer polls, so the workers are run from here
+    bool drained;
+    do {
+      drained = true;
+      for (int i = 0; i < worker_count_; i++) {
+        if (!Drained(i)) {
+          drained = false;
+          PollWorker(i, 0);
+        }
+      }
+    } while (!drained);
+    for (int i = 0; i < worker_count_; i++) {
+      CloseWebSocketSessions(i);
+    }
+    for (auto &probe : health_probes_) {
+      close(probe.second);
+    }
+    health_probes_.clear();
+  } else {
+    for (int i = 0; i < worker_count_; i++) {
+      worker_threads_[i].join();
+    }
   }
-  for (int i = 0; i < kThreadPoolSize; i++) {
+  running_ = false;
+  if (access_log_) access_log_->Stop();
+
+  for (int i = 0; i < worker_count_; i++) {
+    while (!connections_[i].empty()) {
+      CloseConnection(i, *connections_[i].begin());
+    }
+    FreeClosedConnections(i);
     close(worker_epoll_fd_[i]);
+    close(worker_wakeup_fd_[i]);
   }
-  close(sock_fd_);
 }
 
-void HttpServer::CreateSocket() {
-  if ((sock_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
-    throw std::runtime_error("Failed to create a TCP socket");
+void HttpServer::HandOffListeners(const std::string &path,
+                                  std::chrono::milliseconds drain_timeout,
+                                  std::chrono::milliseconds handoff_timeout) {
+  std::vector<int> fds;
+
+  // The new process receives duplicates of the listening sockets, so
+  // pending and future connections are accepted by it once we close ours
+  for (auto &listener : listeners_) {
+    fds.push_back(listener.fd());
+  }
+  offer_file_descriptors(path, fds, handoff_timeout);
+  for (auto &listener : listeners_) {
+    listener.HandOff();
+  }
+  Stop(drain_timeout);
+}
+
+std::vector<int> HttpServer::TakeOverListeners(const std::string &path) {
+  return acquire_file_descriptors(path);
+}
+
+void HttpServer::WriteTrace(std::ostream &out) const {
+  if (tracer_ != nullptr) {
+    tracer_->WriteChromeTrace(out);
+  } else {
+    out << "{\"traceEvents\":[]}\n";
+  }
+}
+
+void HttpServer::StartThreads() {
+  SetUpEpoll();
+  draining_ = false;
+  running_ = true;
+  if (external_event_loop_) {
+    // Every worker waits for new connections too, so that a host blocked
+    // in PollOnce() wakes up for them. Only one of the workers is woken.
+    for (int i = 0; i < worker_count_; i++) {
+      for (auto &listener : listeners_) {
+        control_epoll_event(worker_epoll_fd_[i], EPOLL_CTL_ADD, listener.fd(),
+                            EPOLLIN | EPOLLEXCLUSIVE, nullptr);
+      }
+    }
+    next_health_check_ = std::chrono::steady_clock::now();
+    return;
+  }
+  if (access_log_) access_log_->Start();
+  if (!proxy_routes_.empty()) {
+    health_check_thread_ = std::thread(&HttpServer::CheckUpstreamHealth, this);
+  }
+  listener_thread_ = std::thread(&HttpServer::Listen, this);
+  for (int i = 0; i < worker_count_; i++) {
+    worker_threads_[i] = std::thread(&HttpServer::ProcessEvents, this, i);
   }
 }
 
 void HttpServer::SetUpEpoll() {
-  for (int i = 0; i < kThreadPoolSize; i++) {
+  for (int i = 0; i < worker_count_; i++) {
     if ((worker_epoll_fd_[i] = epoll_create1(0)) < 0) {
       throw std::runtime_error(
           "Failed to create epoll file descriptor for worker");
     }
+    if ((worker_wakeup_fd_[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+      throw std::runtime_error("Failed to create eventfd for worker");
+    }
+    control_epoll_event(worker_epoll_fd_[i], EPOLL_CTL_ADD,
+                        worker_wakeup_fd_[i], EPOLLIN, &worker_wakeup_fd_[i]);
+    next_rebalance_[i] = std::chrono::steady_clock::now() + kRebalanceInterval;
+    next_log_flush_[i] = std::chrono::steady_clock::now();
   }
 }
 
 void HttpServer::Listen() {
-  EventData *client_data;
-  sockaddr_in client_address;
-  socklen_t client_len = sizeof(client_address);
-  int client_fd;
-  int current_worker = 0;
   bool active = true;
 
   // accept new connections and distribute tasks to worker threads
-  while (running_) {
+  while (running_ && !draining_) {
     if (!active) {
       std::this_thread::sleep_for(
           std::chrono::microseconds(sleep_times_(rng_)));
     }
-    client_fd = accept4(sock_fd_, (sockaddr *)&client_address, &client_len,
-                        SOCK_NONBLOCK);
-    if (client_fd < 0) {
-      active = false;
-      continue;
+    active = AcceptConnections();
+  }
+}
+
+bool HttpServer::AcceptConnections() {
+  sockaddr_storage client_address;
+  int client_fd;
+  bool accepted = false;
+
+  // the distributor is not thread-safe, and whoever holds the lock accepts
+  // the connections the others were woken up for
+  std::unique_lock<std::mutex> lock(accept_mutex_, std::try_to_lock);
+  if (!lock.owns_lock() || draining_) return false;
+  for (auto &listener : listeners_) {
+    while ((client_fd = listener.Accept(&client_address)) >= 0) {
+      accepted = true;
+      DispatchConnection(distributor_.Pick(worker_load_, worker_count_),
+                         client_fd, client_address, listener.tls());
+    }
+  }
+  return accepted;
+}
+
+void HttpServer::DispatchConnection(int worker_id, int client_fd,
+                                    const sockaddr_storage &client_address,
+                                    const TlsContext *tls) {
+  TRACE_NOW(accepted);
+  ClientKey key = client_key(client_address);
+  HttpStatusCode verdict = admission_.AdmitConnection(key);
+  if (verdict != HttpStatusCode::Ok) {
+    // a TLS client could not read a plaintext response anyway
+    if (tls != nullptr) {
+      close(client_fd);
+    } else {
+      RejectConnection(client_fd, verdict);
     }
+    return;
+  }
 
-    active = true;
-    client_data = new EventData();
-    client_data->fd = client_fd;
-    control_epoll_event(worker_epoll_fd_[current_worker], EPOLL_CTL_ADD,
-                        client_fd, EPOLLIN, client_data);
-    current_worker++;
-    if (current_worker == HttpServer::kThreadPoolSize) current_worker = 0;
+  EventData *client_data = new EventData();
+  client_data->fd = client_fd;
+  client_data->client_key = key;
+  if (tls != nullptr) {
+    client_data->tls = tls->NewSession(client_fd);
+    client_data->state = ConnectionState::kHandshaking;
+    if (client_data->tls == nullptr) {
+      admission_.ReleaseConnection(key);
+      close(client_fd);
+      delete client_data;
+      return;
+    }
   }
+  metrics_->connections.fetch_add(1, std::memory_order_relaxed);
+  metrics_->active_connections.fetch_add(1, std::memory_order_relaxed);
+  worker_load_[worker_id].connections.fetch_add(1, std::memory_order_relaxed);
+  TRACE_PHASE_AT(client_data->trace, kAccepted, accepted);
+  // the worker owns the connection as soon as it is registered
+  TRACE_PHASE(client_data->trace, kDispatched);
+  std::lock_guard<std::mutex> lock(connections_mutex_[worker_id]);
+  connections_[worker_id].insert(client_data);
+  control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_ADD, client_fd,
+                      EPOLLIN, client_data);
 }
 
 void HttpServer::ProcessEvents(int worker_id) {
-  EventData *data;
-  int epoll_fd = worker_epoll_fd_[worker_id];
   bool active = true;
 
-  while (running_) {
+  while (running_ && !(draining_ && Drained(worker_id))) {
     if (!active) {
       std::this_thread::sleep_for(
           std::chrono::microseconds(sleep_times_(rng_)));
     }
-    int nfds = epoll_wait(worker_epoll_fd_[worker_id],
-                          worker_events_[worker_id], HttpServer::kMaxEvents, 0);
-    if (nfds <= 0) {
-      active = false;
-      continue;
+    active = PollWorker(worker_id, 0) > 0;
+  }
+  CloseWebSocketSessions(worker_id);
+}
+
+int HttpServer::PollOnce(int worker_id, std::chrono::milliseconds timeout) {
+  if (!external_event_loop_ || !running_) {
+    throw std::logic_error("The server is not running an external loop");
+  }
+  if (worker_id < 0 || worker_id >= worker_count_) {
+    throw std::invalid_argument("Invalid worker");
+  }
+  return PollWorker(worker_id, timeout.count());
+}
+
+void HttpServer::RunFor(std::chrono::milliseconds duration, int worker_id) {
+  auto deadline = std::chrono::steady_clock::now() + duration;
+  for (auto now = std::chrono::steady_clock::now(); now < deadline;
+       now = std::chrono::steady_clock::now()) {
+    PollOnce(worker_id,
+             std::min(kMaxPollWait,
+                      std::chrono::duration_cast<std::chrono::milliseconds>(
+                          deadline - now)));
+  }
+}
+
+bool HttpServer::Drained(int worker_id) {
+  std::lock_guard<std::mutex> lock(connections_mutex_[worker_id]);
+  return connections_[worker_id].empty() ||
+         std::chrono::steady_clock::now() >= drain_deadline_;
+}
+
+int HttpServer::PollWorker(int worker_id, int timeout_ms) {
+  EventData *data;
+
+  // events of the previous batch have all been handled by now
+  FreeClosedConnections(worker_id);
+  if (!lingering_connections_[worker_id].empty()) {
+    CloseExpiredLingeringConnections(worker_id);
+  }
+  if (broadcast_pending_[worker_id]) DeliverBroadcasts(worker_id);
+  if (distribution_.migrate_idle_connections && !draining_ &&
+      std::chrono::steady_clock::now() >= next_rebalance_[worker_id]) {
+    MigrateIdleConnections(worker_id);
+    next_rebalance_[worker_id] =
+        std::chrono::steady_clock::now() + kRebalanceInterval;
+  }
+  if (draining_) CloseIdleConnections(worker_id);
+  if (external_event_loop_) {
+    if (!proxy_routes_.empty() && !draining_) PollUpstreamHealth();
+    if (access_log_ &&
+        std::chrono::steady_clock::now() >= next_log_flush_[worker_id]) {
+      access_log_->Flush(worker_id);
+      next_log_flush_[worker_id] =
+          std::chrono::steady_clock::now() + access_log_->flush_interval();
+    }
+  }
+
+  int nfds = epoll_wait(worker_epoll_fd_[worker_id], worker_events_[worker_id],
+                        HttpServer::kMaxEvents, timeout_ms);
+  if (nfds <= 0) {
+    if (worker_load_[worker_id].ready_events.load(
+            std::memory_order_relaxed) != 0) {
+      worker_load_[worker_id].ready_events.store(0,
+                                                 std::memory_order_relaxed);
     }
+    return 0;
+  }
+  worker_load_[worker_id].ready_events.store(nfds, std::memory_order_relaxed);
 
-    active = true;
-    for (int i = 0; i < nfds; i++) {
-      const epoll_event &current_event = worker_events_[worker_id][i];
-      data = reinterpret_cast<EventData *>(current_event.data.ptr);
-      if ((current_event.events & EPOLLHUP) ||
-          (current_event.events & EPOLLERR)) {
-        control_epoll_event(epoll_fd, EPOLL_CTL_DEL, data->fd);
-        close(data->fd);
-        delete data;
-      } else if ((current_event.events == EPOLLIN) ||
-                 (current_event.events == EPOLLOUT)) {
-        HandleEpollEvent(epoll_fd, data, current_event.events);
-      } else {  // something unexpected
-        control_epoll_event(epoll_fd, EPOLL_CTL_DEL, data->fd);
-        close(data->fd);
-        delete data;
+  for (int i = 0; i < nfds; i++) {
+    const epoll_event &current_event = worker_events_[worker_id][i];
+    if (current_event.data.ptr == &worker_wakeup_fd_[worker_id]) {
+      std::uint64_t count;  // reading resets the counter
+      while (read(worker_wakeup_fd_[worker_id], &count, sizeof(count)) < 0 &&
+             errno == EINTR) {
       }
+      if (broadcast_pending_[worker_id]) DeliverBroadcasts(worker_id);
+      continue;
+    }
+    data = reinterpret_cast<EventData *>(current_event.data.ptr);
+    if (data == nullptr) {  // a listener, in the external event loop
+      AcceptConnections();
+    } else if (data->state == ConnectionState::kClosed) {
+      continue;  // closed while handling an earlier event of this batch
+    } else if (data->upstream != nullptr) {
+      HandleUpstreamEvent(worker_id, data, current_event.events);
+    } else if (data->state == ConnectionState::kWebSocket) {
+      HandleWebSocketEvent(worker_id, data, current_event.events);
+    } else if ((current_event.events & EPOLLHUP) ||
+               (current_event.events & EPOLLERR)) {
+      CloseConnection(worker_id, data);
+    } else if (batched_pipeline_ && current_event.events == EPOLLIN &&
+               data->state == ConnectionState::kReading) {
+      if (ReceiveRequest(worker_id, data)) {
+        pipeline_batch_[worker_id].push_back(data);
+      }
+    } else if ((current_event.events == EPOLLIN) ||
+               (current_event.events == EPOLLOUT)) {
+      HandleEpollEvent(worker_id, data);
+    } else {  // something unexpected
+      CloseConnection(worker_id, data);
     }
   }
+  if (!pipeline_batch_[worker_id].empty()) ProcessBatch(worker_id);
+  return nfds;
 }
 
-void HttpServer::HandleEpollEvent(int epoll_fd, EventData *data,
-                                  std::uint32_t events) {
+void HttpServer::HandleEpollEvent(int worker_id, EventData *data) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
   int fd = data->fd;
-  EventData *request, *response;
-
-  if (events == EPOLLIN) {
-    request = data;
-    ssize_t byte_count = recv(fd, request->buffer, kMaxBufferSize, 0);
-    if (byte_count > 0) {  // we have fully received the message
-      response = new EventData();
-      response->fd = fd;
-      HandleHttpData(*request, response);
-      control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, response);
-      delete request;
-    } else if (byte_count == 0) {  // client has closed connection
-      control_epoll_event(epoll_fd, EPOLL_CTL_DEL, fd);
-      close(fd);
-      delete request;
-    } else {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {  // retry
-        request->fd = fd;
-        control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, request);
-      } else {  // other error
-        control_epoll_event(epoll_fd, EPOLL_CTL_DEL, fd);
-        close(fd);
-        delete request;
-      }
+
+  if (data->state == ConnectionState::kHandshaking) {
+    ContinueHandshake(worker_id, data);
+  } else if (data->state == ConnectionState::kProxying) {
+    // the client can take more of the upstream response
+    if (data->peer != nullptr) RelayToClient(worker_id, data->peer, true);
+  } else if (data->state == ConnectionState::kLingering) {
+    // discard anything the client still sends until it closes its end
+    ssize_t byte_count = recv(fd, data->buffer, kMaxBufferSize, 0);
+    if (byte_count == 0 ||
+        (byte_count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+        std::chrono::steady_clock::now() >= data->linger_deadline) {
+      CloseConnection(worker_id, data);
+    }
+  } else if (data->state == ConnectionState::kReading) {
+    if (ReceiveRequest(worker_id, data) && HandleHttpData(worker_id, data)) {
+      data->state = ConnectionState::kWriting;
+      control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, data);
     }
   } else {
-    response = data;
-    ssize_t byte_count =
-        send(fd, response->buffer + response->cursor, response->length, 0);
-    if (byte_count >= 0) {
-      if (byte_count < response->length) {  // there are still bytes to write
-        response->cursor += byte_count;
-        response->length -= byte_count;
-        control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, response);
-      } else {  // we have written the complete message
-        request = new EventData();
-        request->fd = fd;
-        control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, request);
-        delete response;
-      }
-    } else {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {  // retry
-        control_epoll_event(epoll_fd, EPOLL_CTL_ADD, fd, EPOLLOUT, response);
-      } else {  // other error
-        control_epoll_event(epoll_fd, EPOLL_CTL_DEL, fd);
-        close(fd);
-        delete response;
-      }
+    SendResponse(worker_id, data, false);
+  }
+}
+
+bool HttpServer::ReceiveRequest(int worker_id, EventData *data) {
+  // a TLS session may have to write while reading and the other way around,
+  // so the events to wait for come from it
+  std::uint32_t wait_events = EPOLLIN;
+  ssize_t byte_count =
+      data->tls != nullptr
+          ? tls_recv(data->tls, data->buffer, kMaxBufferSize, &wait_events)
+          : recv(data->fd, data->buffer, kMaxBufferSize, 0);
+  if (byte_count > 0) {  // we have fully received the message
+    TRACE_PHASE(data->trace, kReceived);
+    data->length = byte_count;
+    return true;
+  }
+  if (byte_count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {  // retry
+    control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_MOD, data->fd,
+                        wait_events, data);
+  } else {  // client has closed connection, or other error
+    CloseConnection(worker_id, data);
+  }
+  return false;
+}
+
+void HttpServer::SendResponse(int worker_id, EventData *data,
+                              bool watching_input) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
+  int fd = data->fd;
+  std::uint32_t wait_events = EPOLLOUT;
+  ssize_t byte_count;
+
+  if (data->segment_count > 0) {
+    byte_count = send_segments(data, &wait_events);
+  } else if (data->tls != nullptr) {
+    byte_count = tls_send(data->tls, data->buffer + data->cursor, data->length,
+                          &wait_events);
+  } else {
+    byte_count =
+        send(fd, data->buffer + data->cursor, data->length, MSG_NOSIGNAL);
+  }
+  if (byte_count >= 0) {
+    if (byte_count < data->length) {  // there are still bytes to write
+      data->cursor += byte_count;
+      data->length -= byte_count;
+      control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, data);
+    } else {  // we have written the complete message
+      FinishResponse(worker_id, data, watching_input);
+    }
+  } else {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {  // retry
+      control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, wait_events, data);
+    } else {  // other error
+      CloseConnection(worker_id, data);
     }
   }
 }
 
-void HttpServer::HandleHttpData(const EventData &raw_request,
-                                EventData *raw_response) {
-  std::string request_string(raw_request.buffer), response_string;
+void HttpServer::ProcessBatch(int worker_id) {
+  std::vector<EventData *> &batch = pipeline_batch_[worker_id];
+
+  // every ready connection has been read by now, so handle all requests
+  // before writing anything, and keep the ones that have a response
+  size_t responses = 0;
+  for (EventData *data : batch) {
+    if (data->state == ConnectionState::kReading &&
+        HandleHttpData(worker_id, data)) {
+      batch[responses++] = data;
+    }
+  }
+  // Responses are written right away instead of after another round of
+  // epoll_wait. The connections are still registered for input, which is
+  // where they go back to once the response is written, so only the ones
+  // that could not take all of it need epoll_ctl.
+  for (size_t i = 0; i < responses; i++) {
+    batch[i]->state = ConnectionState::kWriting;
+    SendResponse(worker_id, batch[i], true);
+  }
+  batch.clear();
+}
+
+void HttpServer::ContinueHandshake(int worker_id, EventData *data) {
+  std::uint32_t wait_events;
+
+  switch (tls_handshake(data->tls, &wait_events)) {
+    case 1:
+      if (tls_kernel_send(data->tls)) {
+        metrics_->kernel_tls_connections.fetch_add(1,
+                                                   std::memory_order_relaxed);
+      }
+      data->state = ConnectionState::kReading;
+      control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_MOD, data->fd,
+                          EPOLLIN, data);
+      break;
+    case 0:
+      control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_MOD, data->fd,
+                          wait_events, data);
+      break;
+    default:
+      CloseConnection(worker_id, data);
+  }
+}
+
+bool HttpServer::HandleHttpData(int worker_id, EventData *data) {
+  std::string request_string(data->buffer, data->length);
   HttpRequest http_request;
   HttpResponse http_response;
+  UpstreamGroup *upstreams;
+  const WebSocketRoute *websocket_route;
+  const ContentBundle *bundle;
+  const BundleEntry *entry;
+  bool keep_alive = false;
+  auto request_start = std::chrono::steady_clock::now();
 
+  metrics_->requests.fetch_add(1, std::memory_order_relaxed);
   try {
-    http_request = string_to_request(request_string);
-    http_response = HandleHttpRequest(http_request);
+    if (admission_.Overloaded(worker_load_[worker_id].ready_events.load(
+            std::memory_order_relaxed))) {
+      // shed load before spending any time on the request
+      http_response = HttpResponse(HttpStatusCode::ServiceUnvailable);
+      http_response.SetHeader("Retry-After", "1");
+    } else {
+      http_request = string_to_request(request_string);
+      TRACE_PHASE(data->trace, kParsed);
+      keep_alive = is_persistent_connection(http_request) && !draining_;
+      if (!admission_.AdmitRequest(http_request.uri())) {
+        http_response = HttpResponse(HttpStatusCode::TooManyRequests);
+        http_response.SetHeader("Retry-After", "1");
+      } else if (is_websocket_upgrade(http_request) && !draining_ &&
+                 (websocket_route = FindWebSocketRoute(http_request.uri())) !=
+                     nullptr) {
+        http_response = AcceptWebSocket(data, http_request, websocket_route);
+      } else if ((http_request.method() == HttpMethod::GET ||
+                  http_request.method() == HttpMethod::HEAD) &&
+                 (entry = FindContent(http_request.uri(), &bundle)) !=
+                     nullptr) {
+        if (access_log_) {
+          BeginAccessLogRecord(data, http_request, request_start);
+        }
+        WriteContent(data, http_request, *bundle, *entry, keep_alive);
+        TRACE_PHASE(data->trace, kSerialized);
+        return true;
+      } else if ((upstreams = FindProxyRoute(http_request.uri())) != nullptr) {
+        // the request is forwarded as is, and the upstream response will be
+        // relayed to the client as it arrives
+        data->keep_alive = keep_alive;
+        if (access_log_) {
+          BeginAccessLogRecord(data, http_request, request_start);
+        }
+        std::string connection;
+        if (!keep_alive) {
+          connection = "close";
+        } else if (http_request.version() == HttpVersion::HTTP_1_0) {
+          connection = "Keep-Alive";
+        }
+        if (ForwardRequest(worker_id, data,
+                           forwarded_request(data->fd, http_request,
+                                             request_string),
+                           http_request.method() == HttpMethod::HEAD,
+                           upstreams->Pick(), connection)) {
+          return false;
+        }
+        http_response = HttpResponse(HttpStatusCode::BadGateway);
+      } else {
+        http_response = HandleHttpRequest(http_request);
+        TRACE_PHASE(data->trace, kHandled);
+      }
+    }
   } catch (const std::invalid_argument &e) {
     http_response = HttpResponse(HttpStatusCode::BadRequest);
     http_response.SetContent(e.what());
+    keep_alive = false;
   } catch (const std::logic_error &e) {
     http_response = HttpResponse(HttpStatusCode::HttpVersionNotSupported);
     http_response.SetContent(e.what());
+    keep_alive = false;
   } catch (const std::exception &e) {
     http_response = HttpResponse(HttpStatusCode::InternalServerError);
     http_response.SetContent(e.what());
+    keep_alive = false;
+  }
+
+  // draining may have started while the handler ran
+  if (draining_) keep_alive = false;
+  if (access_log_) BeginAccessLogRecord(data, http_request, request_start);
+  WriteResponse(data, &http_response, http_request, keep_alive);
+  TRACE_PHASE(data->trace, kSerialized);
+  return true;
+}
+
+void HttpServer::WriteResponse(EventData *data, HttpResponse *http_response,
+                               const HttpRequest &http_request,
+                               bool keep_alive) {
+  std::string response_string;
+
+  // A persistent connection needs the message length to find the end of
+  // the response, except for statuses that never carry a body
+  int status_code = static_cast<int>(http_response->status_code());
+  if (status_code >= 200 && status_code != 204 &&
+      http_response->header("Content-Length").empty()) {
+    http_response->SetContent(http_response->content());
+  }
+  if (!keep_alive) {
+    http_response->SetHeader("Connection", "close");
+  } else if (http_request.version() == HttpVersion::HTTP_1_0) {
+    http_response->SetHeader("Connection", "Keep-Alive");
   }
 
   // Set response to write to client
   response_string =
-      to_string(http_response, http_request.method() != HttpMethod::HEAD);
-  memcpy(raw_response->buffer, response_string.c_str(), kMaxBufferSize);
-  raw_response->length = response_string.length();
+      to_string(*http_response, http_request.method() != HttpMethod::HEAD);
+  data->length = response_string.length();
+  data->cursor = 0;
+  data->keep_alive = keep_alive;
+  if (data->length <= kMaxBufferSize) {
+    memcpy(data->buffer, response_string.c_str(), data->length);
+  } else {
+    data->large_response = std::move(response_string);
+    data->segments[0].iov_base = &data->large_response[0];
+    data->segments[0].iov_len = data->length;
+    data->segment_count = 1;
+  }
+  data->access_record.status = status_code;
+  data->access_record.bytes = data->length;
+}
+
+void HttpServer::WriteContent(EventData *data, const HttpRequest &http_request,
+                              const ContentBundle &bundle,
+                              const BundleEntry &entry, bool keep_alive) {
+  const BundleVariant *variant = &entry.identity;
+  if (entry.gzip.headers.length > 0 &&
+      accepts_gzip(http_request.header("Accept-Encoding"))) {
+    variant = &entry.gzip;
+  }
+  std::string if_none_match = http_request.header("If-None-Match");
+  bool not_modified =
+      !if_none_match.empty() &&
+      (if_none_match == "*" ||
+       has_header_token(if_none_match,
+                        std::string(bundle.data(variant->etag),
+                                    variant->etag.length)));
+
+  // the headers and the body are sent from the mapped bundle as they are
+  const BundleBlob &headers =
+      not_modified ? variant->not_modified_headers : variant->headers;
+  const char *end_of_header = kEndOfHeader;
+  if (!keep_alive) {
+    end_of_header = kEndOfHeaderClose;
+  } else if (http_request.version() == HttpVersion::HTTP_1_0) {
+    end_of_header = kEndOfHeaderKeepAlive;
+  }
+  iovec *segments = data->segments;
+  segments[0].iov_base = const_cast<char *>(bundle.data(headers));
+  segments[0].iov_len = headers.length;
+  segments[1].iov_base = const_cast<char *>(end_of_header);
+  segments[1].iov_len = strlen(end_of_header);
+  data->segment_count = 2;
+  if (!not_modified && http_request.method() != HttpMethod::HEAD) {
+    segments[2].iov_base = const_cast<char *>(bundle.data(variant->body));
+    segments[2].iov_len = variant->body.length;
+    data->segment_count = 3;
+  }
+
+  data->length = 0;
+  for (int i = 0; i < data->segment_count; i++) {
+    data->length += segments[i].iov_len;
+  }
+  data->cursor = 0;
+  data->keep_alive = keep_alive;
+  data->access_record.status = not_modified ? 304 : 200;
+  data->access_record.bytes = data->length;
+}
+
+void HttpServer::BeginAccessLogRecord(
+    EventData *data, const HttpRequest &http_request,
+    std::chrono::steady_clock::time_point start) {
+  AccessLogRecord &record = data->access_record;
+  std::string path = http_request.uri().path();
+
+  data->request_start = start;
+  record.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::system_clock::now().time_since_epoch())
+                            .count();
+  record.fd = data->fd;
+  record.method = static_cast<std::uint8_t>(http_request.method());
+  record.path_hash = fnv1a_hash(path.data(), path.length());
+  record.path_length = std::min(path.length(), kAccessLogPathLength);
+  memcpy(record.path, path.data(), record.path_length);
+  memset(record.path + record.path_length, 0,
+         kAccessLogPathLength - record.path_length);
+  record.status = 0;
+  record.bytes = 0;
+}
+
+void HttpServer::FinishResponse(int worker_id, EventData *data,
+                                bool watching_input) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
+
+  TRACE_PHASE(data->trace, kSent);
+  TRACE_COMMIT(tracer_, worker_id, data->trace, data->fd);
+
+  if (access_log_) {
+    data->access_record.latency_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - data->request_start)
+            .count();
+    access_log_->Log(worker_id, data->access_record);
+  }
+
+  data->cursor = 0;
+  data->length = 0;
+  data->segment_count = 0;
+  std::string().swap(data->large_response);
+  if (data->websocket != nullptr) {  // the 101 response has been sent
+    OpenWebSocket(worker_id, data);
+    return;
+  }
+  if (data->keep_alive && !draining_) {
+    data->state = ConnectionState::kReading;
+    if (!watching_input) {
+      control_epoll_event(epoll_fd, EPOLL_CTL_MOD, data->fd, EPOLLIN, data);
+    }
+    return;
+  }
+  StartLingering(worker_id, data);
+}
+
+void HttpServer::StartLingering(int worker_id, EventData *data) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
+
+  // Closing a socket with unread input makes the kernel reset the connection,
+  // which can destroy the response before the client reads it. Instead, send
+  // FIN after the response and keep reading until the client closes its end.
+  if (data->tls != nullptr) tls_shutdown(data->tls);
+  if (shutdown(data->fd, SHUT_WR) < 0) {
+    CloseConnection(worker_id, data);
+    return;
+  }
+  data->state = ConnectionState::kLingering;
+  data->linger_deadline = std::chrono::steady_clock::now() + kLingerTimeout;
+  lingering_connections_[worker_id].emplace(data->linger_deadline, data);
+  control_epoll_event(epoll_fd, EPOLL_CTL_MOD, data->fd, EPOLLIN, data);
+}
+
+void HttpServer::CloseConnection(int worker_id, EventData *data) {
+  if (data->peer != nullptr) {
+    // a proxied exchange cannot go on without both of its connections
+    EventData *peer = data->peer;
+    DetachPeer(data->upstream != nullptr ? data : peer);
+    CloseConnection(worker_id, peer);
+  }
+  if (data->websocket != nullptr) EndWebSocket(worker_id, data);
+
+  control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_DEL, data->fd);
+  if (data->tls != nullptr) {
+    SSL_free(data->tls);
+    data->tls = nullptr;
+  }
+  close(data->fd);
+  if (data->state == ConnectionState::kLingering) {
+    lingering_connections_[worker_id].erase(
+        std::make_pair(data->linger_deadline, data));
+  } else if (data->state == ConnectionState::kUpstreamIdle) {
+    auto &pool = upstream_pool_[worker_id][data->upstream];
+    pool.erase(std::find(pool.begin(), pool.end(), data));
+  }
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_[worker_id]);
+    connections_[worker_id].erase(data);
+  }
+  if (data->upstream == nullptr) {
+    admission_.ReleaseConnection(data->client_key);
+    metrics_->active_connections.fetch_sub(1, std::memory_order_relaxed);
+    worker_load_[worker_id].connections.fetch_sub(1,
+                                                  std::memory_order_relaxed);
+  }
+  data->state = ConnectionState::kClosed;
+  closed_connections_[worker_id].push_back(data);
+}
+
+void HttpServer::FreeClosedConnections(int worker_id) {
+  for (EventData *data : closed_connections_[worker_id]) {
+    delete data;
+  }
+  closed_connections_[worker_id].clear();
+}
+
+void HttpServer::RejectConnection(int fd, HttpStatusCode status_code) {
+  HttpResponse http_response(status_code);
+  http_response.SetHeader("Connection", "close");
+  http_response.SetHeader("Retry-After", "1");
+  http_response.SetContent(std::string());
+
+  // Best effort: the connection is closed right away without reading the
+  // request, so that a rejected client costs as little as possible
+  std::string response_string = to_string(http_response);
+  send(fd, response_string.c_str(), response_string.length(),
+       MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(fd);
+}
+
+void HttpServer::CloseIdleConnections(int worker_id) {
+  std::vector<EventData *> idle, websockets;
+
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_[worker_id]);
+    for (EventData *data : connections_[worker_id]) {
+      if (data->state == ConnectionState::kUpstreamIdle) {
+        idle.push_back(data);
+        continue;
+      }
+      if (data->state == ConnectionState::kWebSocket &&
+          !data->websocket->closing()) {
+        websockets.push_back(data);
+        continue;
+      }
+      if (data->state != ConnectionState::kReading) continue;
+      // a request that has already arrived is still answered
+      char c;
+      if (data->tls != nullptr && tls_pending(data->tls)) continue;
+      if (recv(data->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) continue;
+      idle.push_back(data);
+    }
+  }
+  for (EventData *data : idle) {
+    CloseConnection(worker_id, data);
+  }
+  for (EventData *data : websockets) {
+    data->websocket->Close(WebSocketCloseCode::kGoingAway);
+    FlushWebSocket(worker_id, data);
+  }
+}
+
+void HttpServer::MigrateIdleConnections(int worker_id) {
+  int target = least_connected_worker(worker_load_, worker_count_, worker_id);
+  if (target < 0) return;
+  int excess = worker_load_[worker_id].connections.load() -
+               worker_load_[target].connections.load();
+  if (excess < distribution_.migration_threshold) return;
+  size_t count = std::min(excess / 2, kMaxMigrationsPerRound);
+  std::vector<EventData *> idle;
+
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_[worker_id]);
+    for (EventData *data : connections_[worker_id]) {
+      if (idle.size() == count) break;
+      // only connections waiting for their next request, with nothing
+      // buffered, are safe to move
+      if (data->state != ConnectionState::kReading ||
+          data->upstream != nullptr || data->peer != nullptr) {
+        continue;
+      }
+      char c;
+      if (data->tls != nullptr && tls_pending(data->tls)) continue;
+      if (recv(data->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) continue;
+      idle.push_back(data);
+    }
+    for (EventData *data : idle) {
+      connections_[worker_id].erase(data);
+    }
+  }
+
+  // The connection leaves this epoll instance before joining the other
+  // one, so that only one worker handles its events. Input that arrived in
+  // between is reported by the new epoll instance right away.
+  for (EventData *data : idle) {
+    control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_DEL, data->fd);
+    worker_load_[worker_id].connections.fetch_sub(1,
+                                                  std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(connections_mutex_[target]);
+    connections_[target].insert(data);
+    worker_load_[target].connections.fetch_add(1, std::memory_order_relaxed);
+    control_epoll_event(worker_epoll_fd_[target], EPOLL_CTL_ADD, data->fd,
+                        EPOLLIN, data);
+  }
+}
+
+void HttpServer::CloseExpiredLingeringConnections(int worker_id) {
+  auto &lingering = lingering_connections_[worker_id];
+  auto now = std::chrono::steady_clock::now();
+
+  // connections are ordered by deadline, so stop at the first live one
+  while (!lingering.empty() && lingering.begin()->first <= now) {
+    CloseConnection(worker_id, lingering.begin()->second);
+  }
 }
 
 HttpResponse HttpServer::HandleHttpRequest(const HttpRequest &request) {
@@ -253,6 +1015,344 @@ HttpResponse HttpServer::HandleHttpRequest(const HttpRequest &request) {
   return callback_it->second(request);  // call handler to process the request
 }
 
+const BundleEntry *HttpServer::FindContent(
+    const Uri &uri, const ContentBundle **bundle) const {
+  if (content_bundles_.empty()) return nullptr;
+
+  // nested prefixes sort after their parent, so the longest one is tried
+  // first
+  std::string path = uri.path();
+  for (auto it = content_bundles_.rbegin(); it != content_bundles_.rend();
+       ++it) {
+    const std::string &prefix = it->first;
+    if (path.length() <= prefix.length() || path[prefix.length()] != '/' ||
+        path.compare(0, prefix.length(), prefix) != 0) {
+      continue;
+    }
+    const BundleEntry *entry = it->second->Find(
+        path.data() + prefix.length(), path.length() - prefix.length());
+    if (entry != nullptr) {
+      *bundle = it->second.get();
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+UpstreamGroup *HttpServer::FindProxyRoute(const Uri &uri) const {
+  if (proxy_routes_.empty()) return nullptr;
+
+  // the longest matching prefix wins
+  std::string path = uri.path();
+  UpstreamGroup *group = nullptr;
+  size_t matched = 0;
+  for (const auto &route : proxy_routes_) {
+    if (path.compare(0, route.first.length(), route.first) == 0 &&
+        (group == nullptr || route.first.length() > matched)) {
+      group = route.second.get();
+      matched = route.first.length();
+    }
+  }
+  return group;
+}
+
+bool HttpServer::ForwardRequest(int worker_id, EventData *client,
+                                std::string request, bool head_request,
+                                Upstream *upstream,
+                                const std::string &connection) {
+  if (upstream == nullptr) return false;
+  EventData *conn = AcquireUpstreamConnection(worker_id, upstream);
+  if (conn == nullptr) return false;
+
+  conn->upstream_request = std::move(request);
+  conn->cursor = 0;
+  conn->length = conn->upstream_request.length();
+  conn->framer.Reset(head_request, connection);
+  conn->peer = client;
+  client->peer = conn;
+  client->state = ConnectionState::kProxying;
+  upstream->BeginRequest();
+
+  // the client is not watched for input until the response has been relayed
+  control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_MOD, client->fd,
+                      0, client);
+  return true;
+}
+
+EventData *HttpServer::AcquireUpstreamConnection(int worker_id,
+                                                 Upstream *upstream) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
+  auto &pool = upstream_pool_[worker_id][upstream];
+  EventData *conn;
+
+  if (!pool.empty()) {
+    conn = pool.back();
+    pool.pop_back();
+    conn->reused = true;
+    conn->state = ConnectionState::kUpstreamWriting;
+    control_epoll_event(epoll_fd, EPOLL_CTL_MOD, conn->fd, EPOLLOUT, conn);
+    return conn;
+  }
+
+  int fd = upstream->Connect();
+  if (fd < 0) {
+    upstream->MarkUnhealthy();
+    return nullptr;
+  }
+  conn = new EventData();
+  conn->fd = fd;
+  conn->upstream = upstream;
+  conn->state = ConnectionState::kUpstreamConnecting;
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_[worker_id]);
+    connections_[worker_id].insert(conn);
+  }
+  control_epoll_event(epoll_fd, EPOLL_CTL_ADD, fd, EPOLLOUT, conn);
+  return conn;
+}
+
+void HttpServer::HandleUpstreamEvent(int worker_id, EventData *conn,
+                                     std::uint32_t events) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
+  int fd = conn->fd;
+  ssize_t byte_count;
+
+  // An error or hangup fails the request with 502, unless a response is
+  // being read: recv() then returns what arrived before it, and reports it
+  if ((events & (EPOLLERR | EPOLLHUP)) &&
+      (conn->state != ConnectionState::kUpstreamReading ||
+       !(events & EPOLLIN))) {
+    if (conn->state == ConnectionState::kUpstreamIdle ||
+        conn->peer == nullptr) {
+      CloseConnection(worker_id, conn);
+      return;
+    }
+    if (conn->state == ConnectionState::kUpstreamConnecting) {
+      conn->upstream->MarkUnhealthy();
+    }
+    FailProxying(worker_id, conn);
+    return;
+  }
+
+  switch (conn->state) {
+    case ConnectionState::kUpstreamIdle:
+      // the upstream closed a pooled connection, or sent unexpected data
+      CloseConnection(worker_id, conn);
+      return;
+
+    case ConnectionState::kUpstreamConnecting: {
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+          error != 0) {
+        conn->upstream->MarkUnhealthy();
+        FailProxying(worker_id, conn);
+        return;
+      }
+      conn->state = ConnectionState::kUpstreamWriting;
+    }
+      // the connection is established, fall through to send the request
+      [[fallthrough]];
+    case ConnectionState::kUpstreamWriting:
+      byte_count = send(fd, conn->upstream_request.data() + conn->cursor,
+                        conn->length, MSG_NOSIGNAL);
+      if (byte_count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          FailProxying(worker_id, conn);
+        }
+        return;
+      }
+      conn->cursor += byte_count;
+      conn->length -= byte_count;
+      if (conn->length == 0) {
+        conn->state = ConnectionState::kUpstreamReading;
+        control_epoll_event(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, conn);
+      }
+      return;
+
+    case ConnectionState::kUpstreamReading: {
+      // bytes not relayed yet must not be overwritten while the client is
+      // blocked, the upstream is read again once it catches up
+      if (conn->length > 0) return;
+      // The bytes to relay, with the header sections rewritten, go to
+      // large_response.
+      char chunk[kMaxBufferSize];
+      byte_count = recv(fd, chunk, kMaxBufferSize, 0);
+      if (byte_count > 0) {
+        conn->large_response.clear();
+        size_t relayed =
+            conn->framer.Feed(chunk, byte_count, &conn->large_response);
+        if (conn->framer.failed()) {
+          FailProxying(worker_id, conn);
+          return;
+        }
+        // anything after the end of the response makes the connection unusable
+        if (relayed < static_cast<size_t>(byte_count)) conn->keep_alive = false;
+        conn->cursor = 0;
+        conn->length = conn->large_response.length();
+        RelayToClient(worker_id, conn, false);
+      } else if (byte_count == 0) {
+        conn->framer.FeedEof();
+        conn->keep_alive = false;
+        if (conn->framer.complete()) {
+          FinishProxying(worker_id, conn);
+        } else {
+          FailProxying(worker_id, conn);
+        }
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        FailProxying(worker_id, conn);
+      }
+      return;
+    }
+
+    default:
+      CloseConnection(worker_id, conn);
+      return;
+  }
+}
+
+void HttpServer::RelayToClient(int worker_id, EventData *conn,
+                               bool client_was_blocked) {
+  int epoll_fd = worker_epoll_fd_[worker_id];
+  EventData *client = conn->peer;
+
+  while (conn->length > 0) {
+    std::uint32_t wait_events = EPOLLOUT;
+    const char *pending = conn->large_response.data() + conn->cursor;
+    ssize_t byte_count =
+        client->tls != nullptr
+            ? tls_send(client->tls, pending, conn->length, &wait_events)
+            : send(client->fd, pending, conn->length, MSG_NOSIGNAL);
+    if (byte_count < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        CloseConnection(worker_id, client);
+        return;
+      }
+      // stop reading from the upstream until the client catches up
+      if (!client_was_blocked) {
+        control_epoll_event(epoll_fd, EPOLL_CTL_MOD, conn->fd, 0, conn);
+      }
+      control_epoll_event(epoll_fd, EPOLL_CTL_MOD, client->fd, wait_events,
+                          client);
+      return;
+    }
+    conn->cursor += byte_count;
+    conn->length -= byte_count;
+    client->access_record.bytes += byte_count;
+  }
+
+  if (conn->framer.complete()) {
+    FinishProxying(worker_id, conn);
+  } else if (client_was_blocked) {
+    control_epoll_event(epoll_fd, EPOLL_CTL_MOD, client->fd, 0, client);
+    control_epoll_event(epoll_fd, EPOLL_CTL_MOD, conn->fd, EPOLLIN, conn);
+  }
+}
+
+void HttpServer::FinishProxying(int worker_id, EventData *conn) {
+  EventData *client = conn->peer;
+  auto &pool = upstream_pool_[worker_id][conn->upstream];
+  bool reusable = conn->framer.reusable() && conn->keep_alive;
+
+  // A response that ends by closing the connection ends the client
+  // connection as well. Connection: close only applies to the upstream one.
+  if (conn->framer.close_delimited()) client->keep_alive = false;
+  client->access_record.status = conn->framer.status_code();
+  DetachPeer(conn);
+
+  if (reusable && !draining_ && pool.size() < kMaxIdleUpstreamConnections) {
+    conn->state = ConnectionState::kUpstreamIdle;
+    conn->cursor = 0;
+    conn->length = 0;
+    conn->upstream_request.clear();
+    pool.push_back(conn);
+    control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_MOD, conn->fd,
+                        EPOLLIN, conn);
+  } else {
+    CloseConnection(worker_id, conn);
+  }
+
+  client->state = ConnectionState::kWriting;
+  FinishResponse(worker_id, client);
+}
+
+void HttpServer::FailProxying(int worker_id, EventData *conn) {
+  EventData *client = conn->peer;
+  Upstream *upstream = conn->upstream;
+  bool started = conn->framer.started();
+  bool retry = conn->reused && !started;
+
+  DetachPeer(conn);
+  if (started) {  // part of the response was relayed, the client is lost
+    CloseConnection(worker_id, conn);
+    CloseConnection(worker_id, client);
+    return;
+  }
+
+  // A pooled connection may have been closed by the upstream just before it
+  // was reused, so the request is sent once more over another connection
+  if (retry && ForwardRequest(worker_id, client,
+                              std::move(conn->upstream_request),
+                              conn->framer.head_request(), upstream,
+                              conn->framer.connection())) {
+    CloseConnection(worker_id, conn);
+    return;
+  }
+  CloseConnection(worker_id, conn);
+
+  HttpResponse http_response(HttpStatusCode::BadGateway);
+  WriteResponse(client, &http_response, HttpRequest(), false);
+  client->state = ConnectionState::kWriting;
+  control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_MOD, client->fd,
+                      EPOLLOUT, client);
+}
+
+void HttpServer::DetachPeer(EventData *conn) {
+  conn->upstream->EndRequest();
+  conn->peer->peer = nullptr;
+  conn->peer = nullptr;
+}
+
+void HttpServer::CheckUpstreamHealth() {
+  while (running_ && !draining_) {
+    for (auto &route : proxy_routes_) {
+      route.second->CheckHealth();
+    }
+    // sleep in short steps so that Stop() does not wait a whole interval
+    auto next_check = std::chrono::steady_clock::now() + kHealthCheckInterval;
+    while (running_ && !draining_ &&
+           std::chrono::steady_clock::now() < next_check) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+}
+
+void HttpServer::PollUpstreamHealth() {
+  std::unique_lock<std::mutex> lock(health_check_mutex_, std::try_to_lock);
+  auto now = std::chrono::steady_clock::now();
+  if (!lock.owns_lock() || now < next_health_check_) return;
+
+  // the connections started last time have had the timeout to be established
+  if (!health_probes_.empty()) {
+    for (auto &probe : health_probes_) {
+      probe.first->FinishHealthCheck(probe.second);
+    }
+    health_probes_.clear();
+    next_health_check_ = now + kHealthCheckInterval - kHealthCheckTimeout;
+    return;
+  }
+  for (auto &route : proxy_routes_) {
+    for (size_t i = 0; i < route.second->size(); i++) {
+      Upstream *upstream = route.second->upstream(i);
+      int fd = upstream->StartHealthCheck();
+      if (fd >= 0) health_probes_.emplace_back(upstream, fd);
+    }
+  }
+  next_health_check_ =
+      now + (health_probes_.empty() ? kHealthCheckInterval
+                                    : kHealthCheckTimeout);
+}
+
 void HttpServer::control_epoll_event(int epoll_fd, int op, int fd,
                                      std::uint32_t events, void *data) {
   if (op == EPOLL_CTL_DEL) {
@@ -269,4 +1369,212 @@ void HttpServer::control_epoll_event(int epoll_fd, int op, int fd,
   }
 }
 
+const WebSocketRoute *HttpServer::FindWebSocketRoute(const Uri &uri) const {
+  auto it = websocket_routes_.find(uri.path());
+  return it != websocket_routes_.end() ? it->second.get() : nullptr;
+}
+
+HttpResponse HttpServer::AcceptWebSocket(EventData *data,
+                                         const HttpRequest &request,
+                                         const WebSocketRoute *route) {
+  std::string key = request.header("Sec-WebSocket-Key");
+  if (request.version() != HttpVersion::HTTP_1_1 || key.empty()) {
+    throw std::invalid_argument("Invalid WebSocket handshake");
+  }
+  if (request.header("Sec-WebSocket-Version") != "13") {
+    HttpResponse http_response(HttpStatusCode::UpgradeRequired);
+    http_response.SetHeader("Sec-WebSocket-Version", "13");
+    return http_response;
+  }
+
+  // the session starts once the response has been sent
+  HttpResponse http_response(HttpStatusCode::SwitchingProtocols);
+  http_response.SetHeader("Upgrade", "websocket");
+  http_response.SetHeader("Connection", "Upgrade");
+  http_response.SetHeader("Sec-WebSocket-Accept", websocket_accept_key(key));
+  data->websocket.reset(new WebSocketSession(route));
+  return http_response;
+}
+
+void HttpServer::OpenWebSocket(int worker_id, EventData *data) {
+  WebSocketSession *session = data->websocket.get();
+
+  data->state = ConnectionState::kWebSocket;
+  websocket_sessions_[worker_id].insert(data);
+  control_epoll_event(worker_epoll_fd_[worker_id], EPOLL_CTL_MOD, data->fd,
+                      EPOLLIN, data);
+  try {
+    if (session->route_->handler.on_open) {
+      session->route_->handler.on_open(*session);
+    }
+  } catch (const std::exception &e) {
+    session->Close(WebSocketCloseCode::kInternalError);
+  }
+  FlushWebSocket(worker_id, data);
+}
+
+void HttpServer::HandleWebSocketEvent(int worker_id, EventData *data,
+                                      std::uint32_t events) {
+  WebSocketSession *session = data->websocket.get();
+
+  if (events & EPOLLERR) {
+    CloseConnection(worker_id, data);
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLHUP)) {
+    // input decrypted by a TLS session may be buffered beyond what fits in
+    // the buffer, and epoll will not report it again
+    do {
+      std::uint32_t wait_events = EPOLLIN;
+      ssize_t byte_count =
+          data->tls != nullptr
+              ? tls_recv(data->tls, data->buffer, kMaxBufferSize, &wait_events)
+              : recv(data->fd, data->buffer, kMaxBufferSize, 0);
+      if (byte_count == 0 || (byte_count < 0 && errno != EAGAIN &&
+                              errno != EWOULDBLOCK)) {
+        CloseConnection(worker_id, data);
+        return;
+      }
+      if (byte_count < 0) break;
+      try {
+        session->Receive(data->buffer, byte_count);
+      } catch (const std::length_error &e) {
+        session->Close(WebSocketCloseCode::kMessageTooBig);
+      } catch (const std::invalid_argument &e) {
+        session->Close(WebSocketCloseCode::kProtocolError);
+      } catch (const std::exception &e) {
+        session->Close(WebSocketCloseCode::kInternalError);
+      }
+    } while (!session->closing() && data->tls != nullptr &&
+             tls_pending(data->tls));
+  }
+  FlushWebSocket(worker_id, data);
+}
+
+void HttpServer::FlushWebSocket(int worker_id, EventData *data) {
+  WebSocketSession *session = data->websocket.get();
+  int epoll_fd = worker_epoll_fd_[worker_id];
+  auto &queue = session->send_queue_;
+
+  if (session->overflowed_) {  // the client is too slow to keep up
+    CloseConnection(worker_id, data);
+    return;
+  }
+  while (!queue.empty()) {
+    std::uint32_t wait_events = EPOLLOUT;
+    ssize_t byte_count;
+    if (data->tls != nullptr) {
+      const std::string &frame = *queue.front();
+      byte_count = tls_send(data->tls, frame.data() + session->send_offset_,
+                            frame.length() - session->send_offset_,
+                            &wait_events);
+    } else {
+      // queued frames go out in a single system call
+      iovec iov[kMaxWebSocketIovecs];
+      msghdr message = {};
+      size_t count = 0;
+      for (auto it = queue.begin();
+           it != queue.end() && count < kMaxWebSocketIovecs; ++it, ++count) {
+        size_t offset = count == 0 ? session->send_offset_ : 0;
+        iov[count].iov_base = const_cast<char *>((*it)->data() + offset);
+        iov[count].iov_len = (*it)->length() - offset;
+      }
+      message.msg_iov = iov;
+      message.msg_iovlen = count;
+      byte_count = sendmsg(data->fd, &message, MSG_NOSIGNAL);
+    }
+    if (byte_count < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        CloseConnection(worker_id, data);
+      } else if (!session->write_blocked_) {
+        session->write_blocked_ = true;
+        control_epoll_event(epoll_fd, EPOLL_CTL_MOD, data->fd,
+                            EPOLLIN | wait_events, data);
+      }
+      return;
+    }
+    session->Consume(byte_count);
+  }
+
+  if (session->closing()) {
+    EndWebSocket(worker_id, data);
+    StartLingering(worker_id, data);
+  } else if (session->write_blocked_) {
+    session->write_blocked_ = false;
+    control_epoll_event(epoll_fd, EPOLL_CTL_MOD, data->fd, EPOLLIN, data);
+  }
+}
+
+void HttpServer::EndWebSocket(int worker_id, EventData *data) {
+  WebSocketSession *session = data->websocket.get();
+
+  if (websocket_sessions_[worker_id].erase(data) == 0) return;
+  try {
+    if (session->route_->handler.on_close) {
+      session->route_->handler.on_close(*session);
+    }
+  } catch (const std::exception &e) {
+    // the session is gone either way
+  }
+}
+
+void HttpServer::CloseWebSocketSessions(int worker_id) {
+  // closing a session removes it from the set
+  std::vector<EventData *> sessions(websocket_sessions_[worker_id].begin(),
+                                    websocket_sessions_[worker_id].end());
+  for (EventData *data : sessions) {
+    CloseConnection(worker_id, data);
+  }
+}
+
+void HttpServer::Broadcast(const std::string &path, WebSocketOpcode opcode,
+                           const std::string &payload) {
+  const WebSocketRoute *route = FindWebSocketRoute(Uri(path));
+  if (route == nullptr) {
+    throw std::invalid_argument("No WebSocket route for " + path);
+  }
+
+  auto frame = std::make_shared<const std::string>(
+      encode_websocket_frame(opcode, payload));
+  for (int i = 0; i < worker_count_; i++) {
+    std::lock_guard<std::mutex> lock(broadcasts_mutex_[i]);
+    broadcasts_[i].emplace_back(route, frame);
+    // a worker with broadcasts pending has already been woken up
+    if (!broadcast_pending_[i].exchange(true) && running_) WakeUpWorker(i);
+  }
+}
+
+void HttpServer::WakeUpWorker(int worker_id) {
+  std::uint64_t one = 1;
+  // fails only when the counter is full, and then the worker is awake
+  while (write(worker_wakeup_fd_[worker_id], &one, sizeof(one)) < 0 &&
+         errno == EINTR) {
+  }
+}
+
+void HttpServer::DeliverBroadcasts(int worker_id) {
+  std::vector<std::pair<const WebSocketRoute *,
+                        std::shared_ptr<const std::string>>>
+      broadcasts;
+
+  {
+    std::lock_guard<std::mutex> lock(broadcasts_mutex_[worker_id]);
+    broadcasts.swap(broadcasts_[worker_id]);
+    broadcast_pending_[worker_id] = false;
+  }
+  // flushing may end sessions, which removes them from the set
+  std::vector<EventData *> sessions(websocket_sessions_[worker_id].begin(),
+                                    websocket_sessions_[worker_id].end());
+  for (EventData *data : sessions) {
+    WebSocketSession *session = data->websocket.get();
+    if (session->closing()) continue;
+    for (const auto &broadcast : broadcasts) {
+      if (broadcast.first == session->route_) {
+        session->Enqueue(broadcast.second);
+      }
+    }
+    FlushWebSocket(worker_id, data);
+  }
+}
+
 }  // namespace simple_http_server
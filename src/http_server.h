@@ -7,32 +7,186 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <random>
+#include <set>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include "access_log.h"
+#include "admission_control.h"
+#include "content_bundle.h"
 #include "http_message.h"
+#include "listener.h"
+#include "listener_handoff.h"
+#include "reverse_proxy.h"
+#include "tls.h"
+#include "trace.h"
 #include "uri.h"
+#include "websocket.h"
+#include "worker_distribution.h"
 
 namespace simple_http_server {
 
-// Maximum size of an HTTP message is limited by how much bytes
-// we can read or send via socket each time
+// Maximum size of an HTTP request is limited by how much bytes
+// we can read via socket each time. Larger responses are kept on the heap.
 constexpr size_t kMaxBufferSize = 4096;
 
+// How long a closing connection keeps draining client input after its
+// write side has been shut down, so the final response is not lost to a RST
+constexpr std::chrono::seconds kLingerTimeout(2);
+
+// How long Stop() waits for in-flight requests before closing connections
+constexpr std::chrono::milliseconds kDrainTimeout(5000);
+
+// Pieces of a response sent from a content bundle: the header fields, the
+// end of the header and the body
+constexpr int kMaxResponseSegments = 3;
+
+// Requests each worker keeps in the trace when tracing is compiled in
+constexpr size_t kTraceSpansPerWorker = 4096;
+
+// Most workers a server can run
+constexpr int kMaxWorkers = 5;
+
+// A connection alternates between reading a request and writing the response,
+// after a handshake on TLS listeners.
+// After the final response is flushed, the write side is shut down and the
+// connection lingers, discarding input until the client closes its end.
+// A client connection whose request is forwarded to an upstream stays in
+// kProxying until the whole upstream response has been relayed, and the
+// connection to the upstream goes through the kUpstream* states.
+// A connection upgraded to the WebSocket protocol stays in kWebSocket.
+// Closed connections are freed once the current batch of events is handled.
+enum class ConnectionState {
+  kHandshaking,
+  kReading,
+  kWriting,
+  kLingering,
+  kProxying,
+  kUpstreamConnecting,
+  kUpstreamWriting,
+  kUpstreamReading,
+  kUpstreamIdle,
+  kWebSocket,
+  kClosed
+};
+
+// Per-connection data, allocated on accept and freed when the connection is
+// closed. The buffer holds the request while reading and the response while
+// writing.
 struct EventData {
-  EventData() : fd(0), length(0), cursor(0), buffer() {}
+  EventData()
+      : fd(0),
+        length(0),
+        cursor(0),
+        state(ConnectionState::kReading),
+        keep_alive(true),
+        linger_deadline(),
+        client_key(0),
+        upstream(nullptr),
+        peer(nullptr),
+        reused(false),
+        framer(),
+        tls(nullptr),
+        websocket(),
+        request_start(),
+        access_record(),
+        segments(),
+        segment_count(0),
+        large_response(),
+        upstream_request(),
+        buffer() {}
   int fd;
   size_t length;
   size_t cursor;
+  ConnectionState state;
+  bool keep_alive;
+  std::chrono::steady_clock::time_point linger_deadline;
+  ClientKey client_key;
+  // Set on connections to an upstream, whose buffer holds the forwarded
+  // request and then the response bytes not yet relayed to the client.
+  // While a request is being proxied, the client and upstream connections
+  // point to each other through `peer`.
+  Upstream* upstream;
+  EventData* peer;
+  bool reused;
+  ResponseFramer framer;
+  // Session of a connection accepted on a TLS listener
+  SSL* tls;
+  // Set when the connection is upgraded to the WebSocket protocol
+  std::unique_ptr<WebSocketSession> websocket;
+  // Filled in while a request is handled when the access log is enabled
+  std::chrono::steady_clock::time_point request_start;
+  AccessLogRecord access_record;
+  // Set while sending a response from a content bundle, which is sent from
+  // these pieces instead of the buffer
+  iovec segments[kMaxResponseSegments];
+  int segment_count;
+  // A response that does not fit in the buffer, sent through `segments`.
+  // On an upstream connection, the response bytes to relay to the client.
+  std::string large_response;
+  // On an upstream connection, the request being sent, which is kept until
+  // the response starts in case it has to be retried on another connection.
+  // The proxy adds header fields, so it can outgrow the buffer.
+  std::string upstream_request;
+#ifdef SIMPLE_HTTP_SERVER_TRACING
+  TraceSpan trace;
+#endif
   char buffer[kMaxBufferSize];
 };
 
+// Counters updated by the workers as they go. They can be read at any time,
+// including by another process when they live in shared memory.
+struct ServerMetrics {
+  ServerMetrics()
+      : connections(0),
+        active_connections(0),
+        requests(0),
+        kernel_tls_connections(0) {}
+  std::atomic<std::uint64_t> connections;
+  std::atomic<std::int64_t> active_connections;
+  std::atomic<std::uint64_t> requests;
+  // TLS connections whose records the kernel encrypts
+  std::atomic<std::uint64_t> kernel_tls_connections;
+};
+
+// Settings of a server, which can also be changed one at a time with the
+// setters of HttpServer. New fields are only added at the end, with defaults
+// that keep the previous behavior, so that code built against an older
+// version still compiles.
+struct HttpServerOptions {
+  HttpServerOptions()
+      : workers(kMaxWorkers),
+        distribution(),
+        batched_pipeline(false),
+        external_event_loop(false) {}
+  // From 1 to kMaxWorkers
+  int workers;
+  DistributionOptions distribution;
+  // See HttpServer::EnableBatchedPipeline()
+  bool batched_pipeline;
+  // Start() starts no threads at all. The host application runs each
+  // worker instead, from threads of its own, by calling
+  // HttpServer::PollOnce() or HttpServer::RunFor(). Polling the workers also
+  // runs the upstream health checks and writes the access log.
+  bool external_event_loop;
+};
+
+class PreforkServer;
+
 // A request handler should expect a request as argument and returns a response
 using HttpRequestHandler_t = std::function<HttpResponse(const HttpRequest&)>;
 
@@ -42,17 +196,123 @@ using HttpRequestHandler_t = std::function<HttpResponse(const HttpRequest&)>;
 // - Possibly many threads that process HTTP messages and communicate with
 // clients via socket.
 //   The number of workers is defined by a constant
+// In the external event loop mode, the threads of the host application run
+// the workers instead, and accept new connections.
 class HttpServer {
  public:
+  // A server with a single TCP listener
   explicit HttpServer(const std::string& host, std::uint16_t port);
+  // Adopts listening sockets that are already bound, for example the ones
+  // handed off by a previous server process
+  explicit HttpServer(const std::vector<int>& listening_fds);
   ~HttpServer() = default;
 
-  HttpServer() = default;
+  HttpServer();
   HttpServer(HttpServer&&) = default;
   HttpServer& operator=(HttpServer&&) = default;
 
+  // Listeners must be added before Start(), and all of them feed the same
+  // workers. A TCP listener uses IPv6 when `host` is an IPv6 address.
+  void AddTcpListener(const std::string& host, std::uint16_t port,
+                      const ListenerOptions& options = ListenerOptions()) {
+    listeners_.emplace_back(host, port, options);
+  }
+  void AddUnixListener(const std::string& path,
+                       const ListenerOptions& options = ListenerOptions()) {
+    listeners_.push_back(Listener::Unix(path, options));
+  }
+  // A TCP listener whose connections are encrypted with the certificate in
+  // `tls`. Throws std::runtime_error if it cannot be loaded.
+  void AddTlsListener(const std::string& host, std::uint16_t port,
+                      const TlsOptions& tls,
+                      const ListenerOptions& options = ListenerOptions()) {
+    AddTcpListener(host, port, options);
+    EnableTls(listeners_.size() - 1, tls);
+  }
+  // Turns on TLS for the listener at index `listener`, for example one
+  // adopted from a previous server process
+  void EnableTls(size_t listener, const TlsOptions& tls) {
+    listeners_.at(listener).EnableTls(std::make_shared<TlsContext>(tls));
+  }
+
+  // Applies all the options at once. Must be called before Start().
+  void Configure(const HttpServerOptions& options);
+  // Number of worker threads, from 1 to 5. Must be called before Start().
+  void SetWorkerCount(int count);
+
   void Start();
-  void Stop();
+  // Stops accepting new connections, then lets in-flight requests finish.
+  // Idle keep-alive connections are closed right away and busy ones are
+  // answered with "Connection: close". Connections still open when the
+  // timeout expires are closed.
+  void Stop(std::chrono::milliseconds drain_timeout = kDrainTimeout);
+  // Zero-downtime restart: waits for the replacement process to connect to
+  // the Unix domain socket at `path`, passes it the listening sockets, and
+  // then drains like Stop(). Throws std::runtime_error, and keeps serving,
+  // if no process connects within `handoff_timeout`.
+  void HandOffListeners(
+      const std::string& path,
+      std::chrono::milliseconds drain_timeout = kDrainTimeout,
+      std::chrono::milliseconds handoff_timeout = kHandoffTimeout);
+  // Called by the replacement process to receive the listening sockets from
+  // a server waiting in HandOffListeners
+  static std::vector<int> TakeOverListeners(const std::string& path);
+  // Admission control must be configured before calling Start()
+  void SetAdmissionPolicy(const AdmissionPolicy& policy) {
+    admission_.SetPolicy(policy);
+  }
+  void SetRouteRateLimit(const std::string& path, double requests_per_second,
+                         size_t burst) {
+    admission_.SetRouteRateLimit(Uri(path), requests_per_second, burst);
+  }
+  // How new connections are spread among the workers. Must be called before
+  // Start().
+  void SetDistributionOptions(const DistributionOptions& options) {
+    distribution_ = options;
+    distributor_.SetPolicy(options.policy);
+  }
+  // Handles the events of each epoll_wait in stages instead of one
+  // connection at a time: reads every ready connection, then handles all the
+  // requests read, then writes all the responses right away. Must be called
+  // before Start().
+  void EnableBatchedPipeline(bool enabled = true) {
+    batched_pipeline_ = enabled;
+  }
+  // Logs every request to the file at `path`. Must be called before Start().
+  void EnableAccessLog(const std::string& path,
+                       const AccessLogOptions& options = AccessLogOptions()) {
+    access_log_.reset(new AccessLog(path, kThreadPoolSize, options));
+  }
+  // Forwards requests whose path starts with `path_prefix` to one of the
+  // upstream targets, reusing keep-alive connections to them. Must be called
+  // before Start().
+  void RegisterProxyRoute(
+      const std::string& path_prefix, const std::vector<UpstreamTarget>& targets,
+      LoadBalancingPolicy policy = LoadBalancingPolicy::kRoundRobin) {
+    proxy_routes_[Uri(path_prefix).path()].reset(
+        new UpstreamGroup(targets, policy));
+  }
+  // Serves the files of the content bundle at `path` under `url_prefix`,
+  // straight from the mapped file. Must be called before Start(). Throws
+  // std::runtime_error if the bundle cannot be mapped.
+  void MountContentBundle(const std::string& url_prefix,
+                          const std::string& path) {
+    std::string prefix = Uri(url_prefix).path();
+    if (!prefix.empty() && prefix.back() == '/') prefix.pop_back();
+    content_bundles_[prefix].reset(new ContentBundle(path));
+  }
+  // Accepts WebSocket connections on `path`. Must be called before Start().
+  void RegisterWebSocketHandler(const std::string& path,
+                                const WebSocketHandler& handler) {
+    std::string route_path = Uri(path).path();
+    websocket_routes_[route_path].reset(
+        new WebSocketRoute{route_path, handler});
+  }
+  // Sends a message to every session of the WebSocket route at `path`. It
+  // can be called from any thread: the frame is encoded once, and each
+  // worker queues it on its own sessions.
+  void Broadcast(const std::string& path, WebSocketOpcode opcode,
+                 const std::string& payload);
   void RegisterHttpRequestHandler(const std::string& path, HttpMethod method,
                                   const HttpRequestHandler_t callback) {
     Uri uri(path);
@@ -63,36 +323,190 @@ class HttpServer {
     request_handlers_[uri].insert(std::make_pair(method, std::move(callback)));
   }
 
-  std::string host() const { return host_; }
-  std::uint16_t port() const { return port_; }
+  // Address of the first listener
+  std::string host() const {
+    return listeners_.empty() ? std::string() : listeners_[0].host();
+  }
+  std::uint16_t port() const {
+    return listeners_.empty() ? 0 : listeners_[0].port();
+  }
+  const std::vector<Listener>& listeners() const { return listeners_; }
+  const AccessLog* access_log() const { return access_log_.get(); }
+  const ServerMetrics& metrics() const { return *metrics_; }
+  // Client connections currently owned by worker `worker`
+  int worker_connections(int worker) const {
+    return worker_load_[worker].connections.load(std::memory_order_relaxed);
+  }
+  // Writes the phases of the latest requests of each worker as Chrome trace
+  // events. The trace is empty unless tracing is compiled in.
+  void WriteTrace(std::ostream& out) const;
+  bool tracing() const { return tracer_ != nullptr; }
+  // External event loop: runs one round of worker `worker_id`, waiting up
+  // to `timeout` for events, and returns the number of events handled. New
+  // connections are accepted by whichever worker is polled, and handed to
+  // the worker picked by the distribution policy, so every worker must be
+  // polled regularly. Each worker must be polled by one thread at a time.
+  // Stop() runs the workers itself, once the host has stopped polling.
+  int PollOnce(int worker_id = 0,
+               std::chrono::milliseconds timeout =
+                   std::chrono::milliseconds(0));
+  // Polls worker `worker_id` until `duration` has passed
+  void RunFor(std::chrono::milliseconds duration, int worker_id = 0);
   bool running() const { return running_; }
+  bool draining() const { return draining_; }
 
  private:
-  static constexpr int kBacklogSize = 1000;
   static constexpr int kMaxConnections = 10000;
   static constexpr int kMaxEvents = 10000;
-  static constexpr int kThreadPoolSize = 5;
+  static constexpr int kThreadPoolSize = kMaxWorkers;
+
+  // runs a copy of the server in each of its worker processes
+  friend class PreforkServer;
 
-  std::string host_;
-  std::uint16_t port_;
-  int sock_fd_;
-  bool running_;
+  std::vector<Listener> listeners_;
+  int worker_count_;
+  std::atomic<bool> running_;
+  std::atomic<bool> draining_;
+  std::chrono::steady_clock::time_point drain_deadline_;
   std::thread listener_thread_;
+  std::thread health_check_thread_;
   std::thread worker_threads_[kThreadPoolSize];
   int worker_epoll_fd_[kThreadPoolSize];
+  // eventfd in each worker's epoll, written when other threads leave work
+  // for the worker, so that a worker blocked in epoll_wait() wakes up
+  int worker_wakeup_fd_[kThreadPoolSize];
   epoll_event worker_events_[kThreadPoolSize][kMaxEvents];
+  std::set<std::pair<std::chrono::steady_clock::time_point, EventData*>>
+      lingering_connections_[kThreadPoolSize];
+  // Open connections of each worker, so that they can be drained and freed
+  // on Stop(). The listener adds to it and the worker removes from it.
+  std::set<EventData*> connections_[kThreadPoolSize];
+  std::mutex connections_mutex_[kThreadPoolSize];
+  // Connections closed while handling the current batch of events, which
+  // may still have events pending in that batch
+  std::vector<EventData*> closed_connections_[kThreadPoolSize];
+  // Idle keep-alive connections to each upstream, owned by each worker
+  std::unordered_map<Upstream*, std::vector<EventData*>>
+      upstream_pool_[kThreadPoolSize];
+  // Connections read in the current batch, waiting for their requests to
+  // be handled when the batched pipeline is enabled
+  std::vector<EventData*> pipeline_batch_[kThreadPoolSize];
+  bool batched_pipeline_;
+  bool external_event_loop_;
+  // serializes accepting, which is done by the workers in the external
+  // event loop
+  std::mutex accept_mutex_;
+  // when each worker next compares its load with the others
+  std::chrono::steady_clock::time_point next_rebalance_[kThreadPoolSize];
+  // In the external event loop, the workers take turns at the upstream
+  // health checks and write their own access log records
+  std::mutex health_check_mutex_;
+  std::vector<std::pair<Upstream*, int>> health_probes_;
+  std::chrono::steady_clock::time_point next_health_check_;
+  std::chrono::steady_clock::time_point next_log_flush_[kThreadPoolSize];
+  WorkerLoad worker_load_[kThreadPoolSize];
+  DistributionOptions distribution_;
+  WorkerDistributor distributor_;
+  // Points to own_metrics_ unless a supervisor provides shared memory
+  ServerMetrics own_metrics_;
+  ServerMetrics* metrics_;
+  AdmissionController admission_;
+  std::unique_ptr<AccessLog> access_log_;
+  std::unique_ptr<Tracer> tracer_;
   std::map<Uri, std::map<HttpMethod, HttpRequestHandler_t>> request_handlers_;
+  std::map<std::string, std::unique_ptr<UpstreamGroup>> proxy_routes_;
+  std::map<std::string, std::unique_ptr<WebSocketRoute>> websocket_routes_;
+  // Mounted bundles by URL prefix, without the trailing slash
+  std::map<std::string, std::unique_ptr<ContentBundle>> content_bundles_;
+  // Open WebSocket sessions of each worker
+  std::unordered_set<EventData*> websocket_sessions_[kThreadPoolSize];
+  // Frames broadcast to the sessions of a route, waiting for each worker
+  std::vector<std::pair<const WebSocketRoute*,
+                        std::shared_ptr<const std::string>>>
+      broadcasts_[kThreadPoolSize];
+  std::mutex broadcasts_mutex_[kThreadPoolSize];
+  std::atomic<bool> broadcast_pending_[kThreadPoolSize];
   std::mt19937 rng_;
   std::uniform_int_distribution<int> sleep_times_;
 
-  void CreateSocket();
+  void OpenListeners();
   void SetUpEpoll();
+  void StartThreads();
   void Listen();
+  // Accepts the pending connections of all listeners, and returns true if
+  // there were any. Returns false right away if another thread is at it.
+  bool AcceptConnections();
+  void DispatchConnection(int worker_id, int client_fd,
+                          const sockaddr_storage& client_address,
+                          const TlsContext* tls);
   void ProcessEvents(int worker_id);
-  void HandleEpollEvent(int epoll_fd, EventData* event, std::uint32_t events);
-  void HandleHttpData(const EventData& request, EventData* response);
+  // Runs one round of a worker, and returns the number of events handled
+  int PollWorker(int worker_id, int timeout_ms);
+  // Whether a draining worker is done, or out of time
+  bool Drained(int worker_id);
+  void HandleEpollEvent(int worker_id, EventData* data);
+  // Returns true when a request has been read into the buffer
+  bool ReceiveRequest(int worker_id, EventData* data);
+  // `watching_input` is set when the connection is still registered for
+  // EPOLLIN, which then needs no change once the response is written
+  void SendResponse(int worker_id, EventData* data, bool watching_input);
+  // Handles the requests of pipeline_batch_, then writes their responses
+  void ProcessBatch(int worker_id);
+  void ContinueHandshake(int worker_id, EventData* data);
+  bool HandleHttpData(int worker_id, EventData* data);
+  void WriteResponse(EventData* data, HttpResponse* http_response,
+                     const HttpRequest& http_request, bool keep_alive);
+  void WriteContent(EventData* data, const HttpRequest& http_request,
+                    const ContentBundle& bundle, const BundleEntry& entry,
+                    bool keep_alive);
+  void FinishResponse(int worker_id, EventData* data,
+                      bool watching_input = false);
+  void StartLingering(int worker_id, EventData* data);
+  void BeginAccessLogRecord(EventData* data, const HttpRequest& http_request,
+                            std::chrono::steady_clock::time_point start);
+  void CloseConnection(int worker_id, EventData* data);
+  void FreeClosedConnections(int worker_id);
+  void CloseExpiredLingeringConnections(int worker_id);
+  void CloseIdleConnections(int worker_id);
+  // Hands idle connections over to the least loaded worker when this one
+  // has too many more
+  void MigrateIdleConnections(int worker_id);
+  void RejectConnection(int fd, HttpStatusCode status_code);
   HttpResponse HandleHttpRequest(const HttpRequest& request);
 
+  const BundleEntry* FindContent(const Uri& uri,
+                                 const ContentBundle** bundle) const;
+  UpstreamGroup* FindProxyRoute(const Uri& uri) const;
+  bool ForwardRequest(int worker_id, EventData* client, std::string request,
+                      bool head_request, Upstream* upstream,
+                      const std::string& connection);
+  EventData* AcquireUpstreamConnection(int worker_id, Upstream* upstream);
+  void HandleUpstreamEvent(int worker_id, EventData* conn,
+                           std::uint32_t events);
+  void RelayToClient(int worker_id, EventData* conn, bool client_was_blocked);
+  void FinishProxying(int worker_id, EventData* conn);
+  void FailProxying(int worker_id, EventData* conn);
+  void DetachPeer(EventData* conn);
+  void CheckUpstreamHealth();
+  // One step of the health checks, for the external event loop
+  void PollUpstreamHealth();
+
+  const WebSocketRoute* FindWebSocketRoute(const Uri& uri) const;
+  HttpResponse AcceptWebSocket(EventData* data, const HttpRequest& request,
+                               const WebSocketRoute* route);
+  void OpenWebSocket(int worker_id, EventData* data);
+  void HandleWebSocketEvent(int worker_id, EventData* data,
+                            std::uint32_t events);
+  // Writes queued frames, and closes the connection once a close frame has
+  // been sent
+  void FlushWebSocket(int worker_id, EventData* data);
+  void EndWebSocket(int worker_id, EventData* data);
+  // Closes the sessions still open when a worker stops, on the thread that
+  // runs the worker, so that on_close runs there too
+  void CloseWebSocketSessions(int worker_id);
+  void DeliverBroadcasts(int worker_id);
+  void WakeUpWorker(int worker_id);
+
   void control_epoll_event(int epoll_fd, int op, int fd,
                            std::uint32_t events = 0, void* data = nullptr);
 };
@@ -0,0 +1,197 @@
+#include "listener.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace simple_http_server {
+
+Listener::Listener(const std::string& host, std::uint16_t port,
+                   const ListenerOptions& options)
+    : Listener() {
+  in6_addr address;
+  type_ = inet_pton(AF_INET6, host.c_str(), &address) == 1
+              ? ListenerType::kTcp6
+              : ListenerType::kTcp4;
+  host_ = host;
+  port_ = port;
+  options_ = options;
+}
+
+Listener::Listener(int fd) : Listener() {
+  sockaddr_storage address;
+  socklen_t address_len = sizeof(address);
+  char host[INET6_ADDRSTRLEN];
+
+  if (getsockname(fd, (sockaddr*)&address, &address_len) < 0) {
+    throw std::invalid_argument("Not a listening socket");
+  }
+  fd_ = fd;
+  inherited_ = true;
+  switch (address.ss_family) {
+    case AF_INET: {
+      const sockaddr_in* in = (const sockaddr_in*)&address;
+      type_ = ListenerType::kTcp4;
+      inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+      host_ = host;
+      port_ = ntohs(in->sin_port);
+      break;
+    }
+    case AF_INET6: {
+      const sockaddr_in6* in6 = (const sockaddr_in6*)&address;
+      type_ = ListenerType::kTcp6;
+      inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+      host_ = host;
+      port_ = ntohs(in6->sin6_port);
+      break;
+    }
+    case AF_UNIX:
+      type_ = ListenerType::kUnix;
+      path_ = ((const sockaddr_un*)&address)->sun_path;
+      break;
+    default:
+      throw std::invalid_argument("Unsupported listening socket family");
+  }
+
+  // the listener thread polls accept4, which must not block
+  int flags = fcntl(fd_, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+    throw std::runtime_error("Failed to make the listening socket non-blocking");
+  }
+}
+
+Listener Listener::Unix(const std::string& path,
+                        const ListenerOptions& options) {
+  Listener listener;
+  listener.type_ = ListenerType::kUnix;
+  listener.path_ = path;
+  listener.options_ = options;
+  return listener;
+}
+
+void Listener::Open() {
+  sockaddr_storage address;
+  socklen_t address_len;
+  int family;
+
+  memset(&address, 0, sizeof(address));
+  if (type_ == ListenerType::kUnix) {
+    sockaddr_un* un = (sockaddr_un*)&address;
+    if (path_.length() >= sizeof(un->sun_path)) {
+      throw std::invalid_argument("Unix socket path is too long");
+    }
+    family = un->sun_family = AF_UNIX;
+    strncpy(un->sun_path, path_.c_str(), sizeof(un->sun_path) - 1);
+    address_len = sizeof(sockaddr_un);
+  } else if (type_ == ListenerType::kTcp6) {
+    sockaddr_in6* in6 = (sockaddr_in6*)&address;
+    family = in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port_);
+    if (inet_pton(AF_INET6, host_.c_str(), &in6->sin6_addr) != 1) {
+      throw std::invalid_argument("Invalid IPv6 address: " + host_);
+    }
+    address_len = sizeof(sockaddr_in6);
+  } else {
+    sockaddr_in* in = (sockaddr_in*)&address;
+    family = in->sin_family = AF_INET;
+    in->sin_port = htons(port_);
+    if (inet_pton(AF_INET, host_.c_str(), &in->sin_addr) != 1) {
+      throw std::invalid_argument("Invalid IPv4 address: " + host_);
+    }
+    address_len = sizeof(sockaddr_in);
+  }
+
+  if ((fd_ = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    throw std::runtime_error("Failed to create a listening socket");
+  }
+
+  // options that affect accepted connections must be set before listen()
+  if (type_ == ListenerType::kUnix) {
+    unlink(path_.c_str());  // a socket file left over by a previous run
+  } else {
+    SetOption(SOL_SOCKET, SO_REUSEADDR, 1);
+    if (options_.reuse_port) SetOption(SOL_SOCKET, SO_REUSEPORT, 1);
+    if (type_ == ListenerType::kTcp6) {
+      SetOption(IPPROTO_IPV6, IPV6_V6ONLY, options_.ipv6_only);
+    }
+    if (options_.defer_accept_seconds > 0) {
+      SetOption(IPPROTO_TCP, TCP_DEFER_ACCEPT, options_.defer_accept_seconds);
+    }
+    if (options_.fastopen_queue_length > 0) {
+      SetOption(IPPROTO_TCP, TCP_FASTOPEN, options_.fastopen_queue_length);
+    }
+  }
+  if (options_.receive_buffer_size > 0) {
+    SetOption(SOL_SOCKET, SO_RCVBUF, options_.receive_buffer_size);
+  }
+  if (options_.send_buffer_size > 0) {
+    SetOption(SOL_SOCKET, SO_SNDBUF, options_.send_buffer_size);
+  }
+
+  if (bind(fd_, (sockaddr*)&address, address_len) < 0) {
+    close(fd_);
+    fd_ = -1;
+    throw std::runtime_error("Failed to bind to socket");
+  }
+  owns_path_ = type_ == ListenerType::kUnix;
+
+  // find out the actual port when binding to port 0
+  if (type_ != ListenerType::kUnix &&
+      getsockname(fd_, (sockaddr*)&address, &address_len) == 0) {
+    port_ = ntohs(type_ == ListenerType::kTcp6
+                      ? ((sockaddr_in6*)&address)->sin6_port
+                      : ((sockaddr_in*)&address)->sin_port);
+  }
+
+  if (listen(fd_, options_.backlog) < 0) {
+    Close();
+    std::ostringstream msg;
+    msg << "Failed to listen on ";
+    if (type_ == ListenerType::kUnix) {
+      msg << path_;
+    } else {
+      msg << "port " << port_;
+    }
+    throw std::runtime_error(msg.str());
+  }
+}
+
+int Listener::Accept(sockaddr_storage* address) {
+  socklen_t address_len = sizeof(*address);
+  int fd = accept4(fd_, (sockaddr*)address, &address_len, SOCK_NONBLOCK);
+  if (fd >= 0 && options_.tcp_nodelay && type_ != ListenerType::kUnix) {
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  }
+  return fd;
+}
+
+void Listener::Close() {
+  if (fd_ < 0) return;
+  close(fd_);
+  fd_ = -1;
+  if (owns_path_) unlink(path_.c_str());
+}
+
+void Listener::SetOption(int level, int name, int value) {
+  if (setsockopt(fd_, level, name, &value, sizeof(value)) < 0) {
+    std::ostringstream msg;
+    msg << "Failed to set socket option " << name << " (" << strerror(errno)
+        << ")";
+    close(fd_);
+    fd_ = -1;
+    throw std::runtime_error(msg.str());
+  }
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,105 @@
+// Defines the listening sockets a server accepts connections from, which
+// can be TCP over IPv4 or IPv6, or Unix domain sockets
+
+#ifndef LISTENER_H_
+#define LISTENER_H_
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace simple_http_server {
+
+class TlsContext;
+
+enum class ListenerType { kTcp4, kTcp6, kUnix };
+
+// Socket options of a listener. Buffer sizes and TCP options are ignored
+// when they are 0 or do not apply to the listener type.
+struct ListenerOptions {
+  ListenerOptions()
+      : backlog(1000),
+        reuse_port(true),
+        ipv6_only(true),
+        tcp_nodelay(false),
+        defer_accept_seconds(0),
+        fastopen_queue_length(0),
+        receive_buffer_size(0),
+        send_buffer_size(0) {}
+  int backlog;
+  // SO_REUSEPORT, which lets several processes listen on the same port
+  bool reuse_port;
+  // IPV6_V6ONLY: keep it on to listen on IPv4 with a separate listener,
+  // turn it off to accept IPv4 clients on a single dual-stack socket
+  bool ipv6_only;
+  // TCP_NODELAY, set on every accepted connection
+  bool tcp_nodelay;
+  // TCP_DEFER_ACCEPT: only wake up the server once the request has arrived
+  int defer_accept_seconds;
+  // TCP_FASTOPEN: number of pending TFO connections, 0 disables it
+  int fastopen_queue_length;
+  // SO_RCVBUF and SO_SNDBUF, inherited by accepted connections
+  int receive_buffer_size;
+  int send_buffer_size;
+};
+
+// A listening socket. It is described first and opened by Open(), except
+// when it adopts a socket that is already listening.
+class Listener {
+ public:
+  // A TCP listener, on IPv6 if `host` is an IPv6 address
+  Listener(const std::string& host, std::uint16_t port,
+           const ListenerOptions& options);
+  // Adopts a listening socket inherited from another process
+  explicit Listener(int fd);
+  ~Listener() = default;
+
+  static Listener Unix(const std::string& path,
+                       const ListenerOptions& options);
+
+  // Creates the socket, applies the options, binds and listens. When the
+  // port is 0, it is updated with the one picked by the system.
+  void Open();
+  // Accepts a pending connection as a non-blocking socket, or returns -1
+  int Accept(sockaddr_storage* address);
+  // Closes the socket and removes the socket file of a Unix listener,
+  // unless the socket was handed off to another process
+  void Close();
+  void HandOff() { owns_path_ = false; }
+  // Connections accepted afterwards start with a TLS handshake
+  void EnableTls(std::shared_ptr<TlsContext> tls) { tls_ = std::move(tls); }
+
+  int fd() const { return fd_; }
+  ListenerType type() const { return type_; }
+  std::string host() const { return host_; }
+  std::uint16_t port() const { return port_; }
+  std::string path() const { return path_; }
+  bool inherited() const { return inherited_; }
+  TlsContext* tls() const { return tls_.get(); }
+
+ private:
+  Listener()
+      : type_(ListenerType::kTcp4),
+        port_(0),
+        fd_(-1),
+        inherited_(false),
+        owns_path_(false) {}
+
+  ListenerType type_;
+  std::string host_;
+  std::uint16_t port_;
+  std::string path_;
+  ListenerOptions options_;
+  int fd_;
+  bool inherited_;
+  bool owns_path_;
+  std::shared_ptr<TlsContext> tls_;
+
+  void SetOption(int level, int name, int value);
+};
+
+}  // namespace simple_http_server
+
+#endif  // LISTENER_H_
@@ -0,0 +1,167 @@
+#include "listener_handoff.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace simple_http_server {
+
+namespace {
+
+sockaddr_un make_unix_address(const std::string& path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  if (path.length() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument("Unix socket path is too long");
+  }
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+
+}  // namespace
+
+void send_file_descriptors(int unix_fd, const std::vector<int>& fds) {
+  if (fds.empty() || fds.size() > kMaxHandoffDescriptors) {
+    throw std::invalid_argument("Invalid number of file descriptors");
+  }
+
+  // the descriptor count is sent as regular data so that the receiver can
+  // tell a complete message from a truncated one
+  std::uint32_t count = fds.size();
+  iovec iov;
+  iov.iov_base = &count;
+  iov.iov_len = sizeof(count);
+
+  char control[CMSG_SPACE(sizeof(int) * kMaxHandoffDescriptors)];
+  memset(control, 0, sizeof(control));
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+  if (sendmsg(unix_fd, &message, MSG_NOSIGNAL) < 0) {
+    throw std::runtime_error("Failed to send file descriptors");
+  }
+}
+
+std::vector<int> receive_file_descriptors(int unix_fd) {
+  std::uint32_t count = 0;
+  iovec iov;
+  iov.iov_base = &count;
+  iov.iov_len = sizeof(count);
+
+  char control[CMSG_SPACE(sizeof(int) * kMaxHandoffDescriptors)];
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t byte_count = recvmsg(unix_fd, &message, MSG_CMSG_CLOEXEC);
+  if (byte_count != sizeof(count)) {
+    throw std::runtime_error("Failed to receive file descriptors");
+  }
+
+  std::vector<int> fds;
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    size_t offset = fds.size();
+    fds.resize(offset + n);
+    memcpy(fds.data() + offset, CMSG_DATA(cmsg), sizeof(int) * n);
+  }
+
+  if ((message.msg_flags & MSG_CTRUNC) || fds.size() != count) {
+    for (int fd : fds) close(fd);
+    throw std::runtime_error("Received an incomplete set of file descriptors");
+  }
+  return fds;
+}
+
+void offer_file_descriptors(const std::string& path,
+                            const std::vector<int>& fds,
+                            std::chrono::milliseconds timeout) {
+  sockaddr_un address = make_unix_address(path);
+  int server_fd, peer_fd;
+
+  if ((server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    throw std::runtime_error("Failed to create a Unix domain socket");
+  }
+  unlink(path.c_str());
+  if (bind(server_fd, (sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(server_fd, 1) < 0) {
+    close(server_fd);
+    throw std::runtime_error("Failed to listen on " + path);
+  }
+
+  pollfd pfd;
+  pfd.fd = server_fd;
+  pfd.events = POLLIN;
+  int ready;
+  while ((ready = poll(&pfd, 1, timeout.count())) < 0 && errno == EINTR) {
+  }
+  peer_fd = ready == 1 ? accept4(server_fd, nullptr, nullptr, SOCK_CLOEXEC)
+                       : -1;
+  close(server_fd);
+  unlink(path.c_str());
+  if (ready == 0) {
+    throw std::runtime_error("No process connected to " + path + " in time");
+  }
+  if (peer_fd < 0) {
+    throw std::runtime_error("Failed to accept handoff connection");
+  }
+
+  try {
+    send_file_descriptors(peer_fd, fds);
+  } catch (const std::exception& e) {
+    close(peer_fd);
+    throw;
+  }
+  close(peer_fd);
+}
+
+std::vector<int> acquire_file_descriptors(const std::string& path) {
+  sockaddr_un address = make_unix_address(path);
+  int fd;
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    throw std::runtime_error("Failed to create a Unix domain socket");
+  }
+  if (connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+    close(fd);
+    throw std::runtime_error("Failed to connect to " + path);
+  }
+
+  std::vector<int> fds;
+  try {
+    fds = receive_file_descriptors(fd);
+  } catch (const std::exception& e) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  return fds;
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,39 @@
+// Defines utility functions to pass listening sockets from one server process
+// to another over a Unix domain socket, which allows restarting the server
+// without refusing or dropping connections
+
+#ifndef LISTENER_HANDOFF_H_
+#define LISTENER_HANDOFF_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace simple_http_server {
+
+// Maximum number of file descriptors passed in one handoff message
+constexpr size_t kMaxHandoffDescriptors = 16;
+// How long a handoff waits for the replacement process to connect
+constexpr std::chrono::milliseconds kHandoffTimeout(30000);
+
+// Send or receive a set of file descriptors as SCM_RIGHTS ancillary data over
+// a connected Unix domain socket. Received descriptors are owned by the caller.
+void send_file_descriptors(int unix_fd, const std::vector<int>& fds);
+std::vector<int> receive_file_descriptors(int unix_fd);
+
+// Waits for a single peer to connect to the Unix domain socket at `path`
+// and sends it the given descriptors. The socket file is removed afterwards.
+// Throws std::runtime_error if no peer connects within `timeout`.
+void offer_file_descriptors(
+    const std::string& path, const std::vector<int>& fds,
+    std::chrono::milliseconds timeout = kHandoffTimeout);
+
+// Connects to a process waiting in offer_file_descriptors and returns the
+// descriptors it sends
+std::vector<int> acquire_file_descriptors(const std::string& path);
+
+}  // namespace simple_http_server
+
+#endif  // LISTENER_HANDOFF_H_
@@ -0,0 +1,239 @@
+#include "prefork_server.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_server.h"
+
+namespace simple_http_server {
+
+namespace {
+
+// How often the supervisor checks on its processes
+constexpr std::chrono::milliseconds kSupervisePeriod(20);
+
+// How long processes that ignore the drain timeout get before being killed
+constexpr std::chrono::seconds kKillDelay(1);
+
+std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// Returns true once the process has exited, and reaps it
+bool reap(pid_t pid) {
+  int status;
+  return waitpid(pid, &status, WNOHANG) == pid;
+}
+
+}  // namespace
+
+PreforkServer::PreforkServer(const std::string& host, std::uint16_t port,
+                             const PreforkOptions& options)
+    : options_(options),
+      cpus_(allowed_cpus()),
+      supervisor_pid_(0),
+      slots_(nullptr),
+      slot_count_(0),
+      restarts_(0),
+      running_(false) {
+  server_.AddTcpListener(host, port);
+  server_.SetWorkerCount(options.workers_per_process);
+}
+
+PreforkServer::~PreforkServer() {
+  if (running_) Stop();
+  if (slots_ != nullptr) munmap(slots_, slot_count_ * sizeof(ProcessSlot));
+}
+
+void PreforkServer::Start() {
+  size_t processes = options_.processes;
+  if (processes == 0) processes = std::max<size_t>(cpus_.size(), 1);
+
+  if (slot_count_ != processes) {
+    if (slots_ != nullptr) munmap(slots_, slot_count_ * sizeof(ProcessSlot));
+    void* memory = mmap(nullptr, processes * sizeof(ProcessSlot),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (memory == MAP_FAILED) {
+      slots_ = nullptr;
+      slot_count_ = 0;
+      throw std::runtime_error("Failed to map shared memory for metrics");
+    }
+    slots_ = static_cast<ProcessSlot*>(memory);
+    slot_count_ = processes;
+  }
+  for (size_t i = 0; i < processes; i++) {
+    new (&slots_[i]) ProcessSlot();
+    slots_[i].drain_timeout_ms = kDrainTimeout.count();
+  }
+  restarts_ = 0;
+
+  // the processes inherit the listening sockets, and the kernel spreads the
+  // connections among the ones waiting in accept
+  server_.OpenListeners();
+  supervisor_pid_ = getpid();
+  running_ = true;
+  {
+    std::lock_guard<std::mutex> lock(pids_mutex_);
+    pids_.assign(processes, 0);
+    restart_times_.assign(processes, std::chrono::steady_clock::now());
+  }
+  // The death signal of a process is sent when the thread that forked it
+  // exits, so all of them are forked by the supervisor thread, which lives
+  // until Stop()
+  std::promise<void> forked;
+  std::future<void> started = forked.get_future();
+  supervisor_thread_ =
+      std::thread(&PreforkServer::Supervise, this, std::move(forked));
+  started.wait();
+}
+
+void PreforkServer::Stop(std::chrono::milliseconds drain_timeout) {
+  // The processes must know the timeout before they get any SIGTERM, which
+  // includes their death signal once the supervisor thread exits
+  for (size_t i = 0; i < slot_count_; i++) {
+    slots_[i].drain_timeout_ms = drain_timeout.count();
+  }
+  std::unique_lock<std::mutex> lock(pids_mutex_);
+  // no process is replaced once this is cleared under the lock
+  running_ = false;
+  for (size_t i = 0; i < pids_.size(); i++) {
+    if (pids_[i] != 0) kill(pids_[i], SIGTERM);
+  }
+  lock.unlock();
+  supervisor_thread_.join();
+  lock.lock();
+  auto deadline =
+      std::chrono::steady_clock::now() + drain_timeout + kKillDelay;
+  for (size_t i = 0; i < pids_.size(); i++) {
+    if (pids_[i] == 0) continue;
+    while (!reap(pids_[i])) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        kill(pids_[i], SIGKILL);
+        waitpid(pids_[i], nullptr, 0);
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    pids_[i] = 0;
+    slots_[i].metrics.active_connections = 0;
+  }
+
+  for (auto& listener : server_.listeners_) {
+    listener.Close();
+  }
+}
+
+PreforkMetrics PreforkServer::metrics() const {
+  PreforkMetrics total = {};
+  for (size_t i = 0; i < slot_count_; i++) {
+    const ServerMetrics& metrics = slots_[i].metrics;
+    total.connections += metrics.connections.load(std::memory_order_relaxed);
+    total.active_connections +=
+        metrics.active_connections.load(std::memory_order_relaxed);
+    total.requests += metrics.requests.load(std::memory_order_relaxed);
+  }
+  total.restarts = restarts_;
+  return total;
+}
+
+std::vector<pid_t> PreforkServer::worker_pids() const {
+  std::lock_guard<std::mutex> lock(pids_mutex_);
+  return pids_;
+}
+
+pid_t PreforkServer::Fork(size_t index) {
+  pid_t pid = fork();
+  if (pid < 0) return 0;  // the supervisor tries again later
+  if (pid == 0) RunWorker(index);
+  return pid;
+}
+
+void PreforkServer::RunWorker(size_t index) {
+  // SIGTERM is blocked before any thread starts, so that all threads
+  // inherit the mask and only the sigwait below receives it
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  // the process does not outlive the supervisor
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != supervisor_pid_) _exit(0);
+
+  if (options_.pin_cpus && !cpus_.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus_[index % cpus_.size()], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+
+  // This is a copy of the server as configured in the supervisor, which
+  // keeps ownership of the sockets, and of the socket files of Unix
+  // listeners
+  ProcessSlot& slot = slots_[index];
+  server_.metrics_ = &slot.metrics;
+  for (auto& listener : server_.listeners_) {
+    listener.HandOff();
+  }
+  try {
+    server_.StartThreads();
+    int signal;
+    sigwait(&signals, &signal);
+    server_.Stop(std::chrono::milliseconds(slot.drain_timeout_ms.load()));
+  } catch (const std::exception& e) {
+    _exit(1);
+  }
+  // the destructors and exit handlers belong to the supervisor
+  _exit(0);
+}
+
+void PreforkServer::Supervise(std::promise<void> forked) {
+  {
+    std::lock_guard<std::mutex> lock(pids_mutex_);
+    for (size_t i = 0; i < pids_.size(); i++) pids_[i] = Fork(i);
+  }
+  forked.set_value();
+
+  while (running_) {
+    std::this_thread::sleep_for(kSupervisePeriod);
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(pids_mutex_);
+    for (size_t i = 0; i < pids_.size() && running_; i++) {
+      if (pids_[i] != 0 && reap(pids_[i])) {
+        // the connections of the process died with it
+        pids_[i] = 0;
+        slots_[i].metrics.active_connections = 0;
+        restart_times_[i] = now + options_.restart_delay;
+        restarts_++;
+      } else if (pids_[i] == 0 && now >= restart_times_[i]) {
+        pids_[i] = Fork(i);
+      }
+    }
+  }
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,122 @@
+// Defines the prefork mode: a supervisor process opens the listening
+// sockets and forks worker processes that all accept from them, each one
+// running the usual listener and worker threads. A crash only takes down
+// the connections of one process, which the supervisor replaces.
+
+#ifndef PREFORK_SERVER_H_
+#define PREFORK_SERVER_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "http_message.h"
+#include "http_server.h"
+#include "uri.h"
+
+namespace simple_http_server {
+
+struct PreforkOptions {
+  PreforkOptions()
+      : processes(0),
+        workers_per_process(1),
+        pin_cpus(true),
+        restart_delay(std::chrono::milliseconds(100)) {}
+  // 0 starts one process per CPU the supervisor is allowed to run on
+  size_t processes;
+  // Worker threads of each process
+  int workers_per_process;
+  // Pins each process to its own CPU, in turn
+  bool pin_cpus;
+  // How long a crashed process stays down before it is replaced, so that a
+  // process that crashes on startup does not keep the supervisor busy
+  std::chrono::milliseconds restart_delay;
+};
+
+// Counters summed over the worker processes. The connections of a process
+// that crashed are no longer counted as active.
+struct PreforkMetrics {
+  std::uint64_t connections;
+  std::int64_t active_connections;
+  std::uint64_t requests;
+  std::uint64_t restarts;
+};
+
+class PreforkServer {
+ public:
+  PreforkServer(const std::string& host, std::uint16_t port,
+                const PreforkOptions& options = PreforkOptions());
+  ~PreforkServer();
+
+  PreforkServer(const PreforkServer&) = delete;
+  PreforkServer& operator=(const PreforkServer&) = delete;
+
+  // Handlers run in the worker processes. Anything else, such as other
+  // listeners or proxy routes, is configured on server() before Start().
+  void RegisterHttpRequestHandler(const std::string& path, HttpMethod method,
+                                  const HttpRequestHandler_t callback) {
+    server_.RegisterHttpRequestHandler(path, method, std::move(callback));
+  }
+  void RegisterHttpRequestHandler(const Uri& uri, HttpMethod method,
+                                  const HttpRequestHandler_t callback) {
+    server_.RegisterHttpRequestHandler(uri, method, std::move(callback));
+  }
+  // The server each worker process runs a copy of
+  HttpServer& server() { return server_; }
+
+  // Opens the listeners and forks the worker processes
+  void Start();
+  // Asks every process to stop like HttpServer::Stop(), and kills the ones
+  // still running a second after the drain timeout
+  void Stop(std::chrono::milliseconds drain_timeout = kDrainTimeout);
+
+  PreforkMetrics metrics() const;
+  // Process ids of the workers, 0 for a crashed one not yet replaced
+  std::vector<pid_t> worker_pids() const;
+  std::uint16_t port() const { return server_.port(); }
+  bool running() const { return running_; }
+
+ private:
+  // Counters of one process, on a cache line of their own since the
+  // processes run on different CPUs
+  struct alignas(64) ProcessSlot {
+    ServerMetrics metrics;
+    // set by the supervisor before it asks the process to stop
+    std::atomic<std::int64_t> drain_timeout_ms;
+  };
+
+  HttpServer server_;
+  PreforkOptions options_;
+  std::vector<int> cpus_;
+  pid_t supervisor_pid_;
+  // memory shared with the worker processes, one slot per process
+  ProcessSlot* slots_;
+  size_t slot_count_;
+  std::vector<pid_t> pids_;
+  // when each crashed process may be replaced
+  std::vector<std::chrono::steady_clock::time_point> restart_times_;
+  mutable std::mutex pids_mutex_;
+  std::atomic<std::uint64_t> restarts_;
+  std::atomic<bool> running_;
+  std::thread supervisor_thread_;
+
+  // Forks the process of slot `index`, and returns its pid
+  pid_t Fork(size_t index);
+  // Runs in the forked process, never returns
+  [[noreturn]] void RunWorker(size_t index);
+  // Forks the processes, sets `forked`, then reaps and replaces crashed
+  // processes until Stop()
+  void Supervise(std::promise<void> forked);
+};
+
+}  // namespace simple_http_server
+
+#endif  // PREFORK_SERVER_H_
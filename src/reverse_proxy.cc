@@ -0,0 +1,359 @@
+#include "reverse_proxy.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "http_message.h"
+
+namespace simple_http_server {
+
+namespace {
+
+bool is_hop_by_hop(const std::string& name,
+                   const std::vector<std::string>& connection_options) {
+  static const char* const kHopByHop[] = {"connection", "keep-alive", "te",
+                                          "upgrade"};
+  std::string lower = name;
+  std::transform(lower.begin(), lower.end(), lower.begin(),
+                 [](unsigned char c) { return tolower(c); });
+  if (lower.compare(0, 6, "proxy-") == 0) return true;
+  return std::find(std::begin(kHopByHop), std::end(kHopByHop), lower) !=
+             std::end(kHopByHop) ||
+         std::find(connection_options.begin(), connection_options.end(),
+                   lower) != connection_options.end();
+}
+
+// The lowercase options listed by the Connection fields of a header section
+std::vector<std::string> connection_options(
+    const std::vector<std::string>& lines) {
+  std::vector<std::string> options;
+  for (const auto& line : lines) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) continue;
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return tolower(c); });
+    if (name != "connection") continue;
+    std::istringstream value(line.substr(colon + 1));
+    std::string option;
+    while (std::getline(value, option, ',')) {
+      option.erase(0, option.find_first_not_of(" \t"));
+      option.erase(option.find_last_not_of(" \t\r") + 1);
+      std::transform(option.begin(), option.end(), option.begin(),
+                     [](unsigned char c) { return tolower(c); });
+      if (!option.empty()) options.push_back(option);
+    }
+  }
+  return options;
+}
+
+}  // namespace
+
+std::string rewrite_forwarded_header(const std::string& header,
+                                     const std::string& added_fields) {
+  std::vector<std::string> lines;
+  std::istringstream iss(header);
+  std::string line;
+  while (std::getline(iss, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty()) break;
+    lines.push_back(line);
+  }
+  if (lines.empty()) return header;
+
+  // the protocol version of the received message, which starts a status
+  // line and ends a request line
+  const std::string& start_line = lines[0];
+  size_t version = start_line.compare(0, 5, "HTTP/") == 0
+                       ? 0
+                       : start_line.rfind(" HTTP/");
+  std::string received_protocol = "1.1";
+  if (version != std::string::npos) {
+    version = start_line.find('/', version) + 1;
+    received_protocol = start_line.substr(
+        version, start_line.find(' ', version) - version);
+  }
+
+  std::vector<std::string> options = connection_options(lines);
+  std::string rewritten = start_line + "\r\n";
+  bool removed = false;
+  for (size_t i = 1; i < lines.size(); i++) {
+    // a line folded into the previous field goes with it
+    if (lines[i][0] == ' ' || lines[i][0] == '\t') {
+      if (!removed) rewritten += lines[i] + "\r\n";
+      continue;
+    }
+    size_t colon = lines[i].find(':');
+    removed = colon != std::string::npos &&
+              is_hop_by_hop(lines[i].substr(0, colon), options);
+    if (!removed) rewritten += lines[i] + "\r\n";
+  }
+  rewritten += "Via: " + received_protocol + " " + kProxyPseudonym + "\r\n";
+  rewritten += added_fields;
+  rewritten += "\r\n";
+  return rewritten;
+}
+
+Upstream::Upstream(const UpstreamTarget& target)
+    : target_(target), address_(), healthy_(true), active_requests_(0) {
+  address_.sin_family = AF_INET;
+  address_.sin_port = htons(target.port);
+  if (inet_pton(AF_INET, target.host.c_str(), &address_.sin_addr) != 1) {
+    throw std::invalid_argument("Invalid upstream address: " + target.host);
+  }
+}
+
+int Upstream::Connect() const {
+  int fd, opt = 1;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  if (connect(fd, (const sockaddr*)&address_, sizeof(address_)) < 0 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void Upstream::CheckHealth() {
+  int fd = StartHealthCheck();
+  if (fd < 0) return;
+
+  pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  poll(&pfd, 1, kHealthCheckTimeout.count());
+  FinishHealthCheck(fd);
+}
+
+int Upstream::StartHealthCheck() {
+  int fd = Connect();
+  if (fd < 0) healthy_ = false;
+  return fd;
+}
+
+void Upstream::FinishHealthCheck(int fd) {
+  pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  int error = 0;
+  socklen_t error_len = sizeof(error);
+  healthy_ = poll(&pfd, 1, 0) == 1 &&
+             getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 &&
+             error == 0;
+  close(fd);
+}
+
+UpstreamGroup::UpstreamGroup(const std::vector<UpstreamTarget>& targets,
+                             LoadBalancingPolicy policy)
+    : policy_(policy), next_(0) {
+  if (targets.empty()) {
+    throw std::invalid_argument("Proxy route needs at least one upstream");
+  }
+  for (const auto& target : targets) {
+    upstreams_.emplace_back(new Upstream(target));
+  }
+}
+
+Upstream* UpstreamGroup::Pick() {
+  size_t n = upstreams_.size();
+  size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+  Upstream* picked = nullptr;
+
+  // start from a rotating position so that ties are spread evenly
+  for (size_t i = 0; i < n; i++) {
+    Upstream* candidate = upstreams_[(start + i) % n].get();
+    if (!candidate->healthy()) continue;
+    if (policy_ == LoadBalancingPolicy::kRoundRobin) return candidate;
+    if (picked == nullptr ||
+        candidate->active_requests() < picked->active_requests()) {
+      picked = candidate;
+    }
+  }
+  return picked;
+}
+
+void UpstreamGroup::CheckHealth() {
+  for (auto& upstream : upstreams_) {
+    upstream->CheckHealth();
+  }
+}
+
+void ResponseFramer::Reset(bool head_request, const std::string& connection) {
+  state_ = State::kHeaders;
+  head_request_ = head_request;
+  connection_ = connection;
+  connection_close_ = false;
+  until_close_ = false;
+  status_code_ = 0;
+  remaining_ = 0;
+  line_.clear();
+}
+
+size_t ResponseFramer::Feed(const char* data, size_t length,
+                           std::string* output) {
+  size_t i = 0;
+
+  while (i < length && state_ != State::kDone && state_ != State::kError) {
+    size_t start = i;
+    State state = state_;
+    switch (state_) {
+      case State::kHeaders: {
+        // the end of the header section may be split across two reads
+        size_t old_size = line_.size();
+        line_.append(data + i, length - i);
+        size_t pos = line_.find("\r\n\r\n", old_size >= 3 ? old_size - 3 : 0);
+        if (pos == std::string::npos) {
+          if (line_.size() > kMaxLineBuffer) state_ = State::kError;
+          i = length;
+          break;
+        }
+        i += pos + 4 - old_size;
+        line_.resize(pos + 4);
+        ParseHeaders();
+        if (output != nullptr && state_ != State::kError) {
+          // interim responses keep no Connection field
+          std::string fields;
+          std::string connection = until_close_ ? "close" : connection_;
+          if (state_ != State::kHeaders && !connection.empty()) {
+            fields = "Connection: " + connection + "\r\n";
+          }
+          output->append(rewrite_forwarded_header(line_, fields));
+        }
+        line_.clear();
+        break;
+      }
+      case State::kBody:
+      case State::kChunkData:
+      case State::kChunkEnd: {
+        size_t n = std::min<std::uint64_t>(remaining_, length - i);
+        i += n;
+        remaining_ -= n;
+        if (remaining_ > 0) break;
+        if (state_ == State::kBody) {
+          state_ = State::kDone;
+        } else if (state_ == State::kChunkData) {
+          state_ = State::kChunkEnd;  // CRLF after the chunk data
+          remaining_ = 2;
+        } else {
+          state_ = State::kChunkSize;
+        }
+        break;
+      }
+      case State::kChunkSize:
+      case State::kTrailers: {
+        const char* newline =
+            static_cast<const char*>(memchr(data + i, '\n', length - i));
+        size_t n = newline ? newline - (data + i) + 1 : length - i;
+        line_.append(data + i, n);
+        i += n;
+        if (newline == nullptr) {
+          if (line_.size() > kMaxLineBuffer) state_ = State::kError;
+          break;
+        }
+        if (state_ == State::kTrailers) {
+          // trailer fields end with an empty line
+          if (line_ == "\r\n" || line_ == "\n") state_ = State::kDone;
+        } else {
+          char* end;
+          remaining_ = strtoull(line_.c_str(), &end, 16);
+          if (end == line_.c_str()) {
+            state_ = State::kError;
+          } else {
+            state_ = remaining_ == 0 ? State::kTrailers : State::kChunkData;
+          }
+        }
+        line_.clear();
+        break;
+      }
+      case State::kUntilClose:
+        i = length;
+        break;
+      default:
+        break;
+    }
+    // the header section is not relayed as is
+    if (output != nullptr && state != State::kHeaders) {
+      output->append(data + start, i - start);
+    }
+  }
+  return i;
+}
+
+void ResponseFramer::FeedEof() {
+  if (state_ == State::kUntilClose) {
+    state_ = State::kDone;
+  } else if (state_ != State::kDone) {
+    state_ = State::kError;
+  }
+}
+
+void ResponseFramer::ParseHeaders() {
+  std::istringstream iss(line_);
+  std::string line, version;
+  int status_code = 0;
+  bool chunked = false, has_length = false, keep_alive = false;
+
+  std::getline(iss, line);
+  std::istringstream start_line(line);
+  start_line >> version >> status_code;
+  if (status_code < 100 || status_code > 999) {
+    state_ = State::kError;
+    return;
+  }
+  status_code_ = status_code;
+
+  while (std::getline(iss, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) continue;
+    std::string key = line.substr(0, colon), value = line.substr(colon + 1);
+    std::transform(key.begin(), key.end(), key.begin(),
+                   [](unsigned char c) { return tolower(c); });
+    if (key == "content-length") {
+      remaining_ = strtoull(value.c_str(), nullptr, 10);
+      has_length = true;
+    } else if (key == "transfer-encoding") {
+      chunked = has_header_token(value, "chunked");
+    } else if (key == "connection") {
+      if (has_header_token(value, "close")) connection_close_ = true;
+      if (has_header_token(value, "keep-alive")) keep_alive = true;
+    }
+  }
+  if (version == "HTTP/1.0" && !keep_alive) connection_close_ = true;
+
+  if (status_code / 100 == 1 && status_code != 101) {
+    state_ = State::kHeaders;  // an interim response precedes the final one
+  } else if (status_code == 101) {
+    state_ = State::kUntilClose;  // the connection becomes a tunnel
+    until_close_ = connection_close_ = true;
+  } else if (head_request_ || status_code == 204 || status_code == 304) {
+    state_ = State::kDone;
+  } else if (chunked) {
+    state_ = State::kChunkSize;
+  } else if (has_length) {
+    state_ = remaining_ == 0 ? State::kDone : State::kBody;
+  } else {
+    state_ = State::kUntilClose;
+    until_close_ = connection_close_ = true;
+  }
+}
+
+}  // namespace simple_http_server
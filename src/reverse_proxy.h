@@ -0,0 +1,167 @@
+// Defines the objects used to forward requests to upstream servers:
+// groups of upstream targets with load balancing and health checks, and a
+// parser that finds the end of a relayed response without buffering it
+
+#ifndef REVERSE_PROXY_H_
+#define REVERSE_PROXY_H_
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace simple_http_server {
+
+// How often upstreams are probed, and how long a probe waits for an
+// upstream to accept a connection
+constexpr std::chrono::milliseconds kHealthCheckInterval(1000);
+constexpr std::chrono::milliseconds kHealthCheckTimeout(500);
+
+// Idle connections each worker keeps open to a single upstream
+constexpr size_t kMaxIdleUpstreamConnections = 32;
+
+// Name the proxy gives itself in the Via field of forwarded messages
+constexpr char kProxyPseudonym[] = "simple-http-server";
+
+enum class LoadBalancingPolicy { kRoundRobin, kLeastConnections };
+
+// Rewrites the header section of a message forwarded by the proxy, from the
+// start line to the empty line that ends it. Removes the hop-by-hop fields
+// (RFC 7230, section 6.1): Connection and the fields it names, Keep-Alive,
+// TE, Upgrade and the Proxy-* fields. Then adds a Via field and
+// `added_fields`, which must each end with CRLF.
+// Transfer-Encoding is kept, since the body is relayed with its transfer
+// coding unchanged and the next hop needs it to find the end of the body.
+std::string rewrite_forwarded_header(const std::string& header,
+                                     const std::string& added_fields);
+
+// Address of a backend server, given as an IPv4 address and a port
+struct UpstreamTarget {
+  std::string host;
+  std::uint16_t port;
+};
+
+// A single backend server. It is shared by all workers, so its counters are
+// atomic; its connections are pooled per worker by the server.
+class Upstream {
+ public:
+  explicit Upstream(const UpstreamTarget& target);
+  ~Upstream() = default;
+
+  // Starts a non-blocking connection and returns its file descriptor
+  int Connect() const;
+  // Tries a connection with a timeout and updates the health status
+  void CheckHealth();
+  // The same check without blocking: starts the connection and returns its
+  // descriptor, or -1 after marking the upstream unhealthy. Once the
+  // timeout has passed, FinishHealthCheck() updates the health status from
+  // whether the connection is established and closes it.
+  int StartHealthCheck();
+  void FinishHealthCheck(int fd);
+  void MarkUnhealthy() { healthy_ = false; }
+
+  void BeginRequest() { active_requests_++; }
+  void EndRequest() { active_requests_--; }
+
+  const UpstreamTarget& target() const { return target_; }
+  bool healthy() const { return healthy_; }
+  int active_requests() const { return active_requests_; }
+
+ private:
+  UpstreamTarget target_;
+  sockaddr_in address_;
+  std::atomic<bool> healthy_;
+  std::atomic<int> active_requests_;
+};
+
+// The set of upstreams a proxy route forwards to
+class UpstreamGroup {
+ public:
+  UpstreamGroup(const std::vector<UpstreamTarget>& targets,
+                LoadBalancingPolicy policy);
+  ~UpstreamGroup() = default;
+
+  // Picks a healthy upstream according to the policy, or returns nullptr
+  // when none of them is healthy
+  Upstream* Pick();
+  void CheckHealth();
+
+  size_t size() const { return upstreams_.size(); }
+  Upstream* upstream(size_t i) const { return upstreams_[i].get(); }
+
+ private:
+  std::vector<std::unique_ptr<Upstream>> upstreams_;
+  LoadBalancingPolicy policy_;
+  std::atomic<size_t> next_;
+};
+
+// Follows the framing of an HTTP/1.x response as its bytes are relayed,
+// so that the proxy knows where it ends and whether the upstream connection
+// can be reused. Supports Content-Length, chunked and close-delimited bodies.
+class ResponseFramer {
+ public:
+  ResponseFramer() { Reset(false); }
+  ~ResponseFramer() = default;
+
+  // Prepares for the response to the next request. Responses to HEAD
+  // requests never have a body. `connection` is the Connection field sent
+  // to the client in place of the upstream's, if not empty.
+  void Reset(bool head_request,
+             const std::string& connection = std::string());
+  // Consumes relayed bytes and returns how many of them belong to the
+  // current response; the rest would be garbage from the upstream.
+  // The bytes to send to the client are appended to `output`, with each
+  // header section rewritten by rewrite_forwarded_header().
+  size_t Feed(const char* data, size_t length,
+              std::string* output = nullptr);
+  // Signals that the upstream closed the connection
+  void FeedEof();
+
+  bool complete() const { return state_ == State::kDone; }
+  bool failed() const { return state_ == State::kError; }
+  // Whether any byte of the response has been seen
+  bool started() const { return state_ != State::kHeaders || !line_.empty(); }
+  // Whether the upstream connection can carry another request
+  bool reusable() const { return complete() && !connection_close_; }
+  // Whether the body ends when the connection closes, which the client's
+  // connection then has to do as well
+  bool close_delimited() const { return until_close_; }
+  bool head_request() const { return head_request_; }
+  const std::string& connection() const { return connection_; }
+  int status_code() const { return status_code_; }
+
+ private:
+  enum class State {
+    kHeaders,
+    kBody,
+    kChunkSize,
+    kChunkData,
+    kChunkEnd,
+    kTrailers,
+    kUntilClose,
+    kDone,
+    kError
+  };
+
+  // Upper bound for a header section or a chunk size line
+  static constexpr size_t kMaxLineBuffer = 16384;
+
+  State state_;
+  bool head_request_;
+  bool connection_close_;
+  bool until_close_;
+  int status_code_;
+  std::uint64_t remaining_;
+  std::string line_;
+  std::string connection_;
+
+  void ParseHeaders();
+};
+
+}  // namespace simple_http_server
+
+#endif  // REVERSE_PROXY_H_
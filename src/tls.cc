@@ -0,0 +1,147 @@
+#include "tls.h"
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/epoll.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+
+namespace simple_http_server {
+
+namespace {
+
+const unsigned char kSessionIdContext[] = "simple_http_server";
+
+std::string last_tls_error() {
+  char message[256];
+  ERR_error_string_n(ERR_get_error(), message, sizeof(message));
+  return message;
+}
+
+// Maps the result of SSL_read_ex() or SSL_write_ex() to the recv()/send()
+// convention
+ssize_t finish_tls_io(SSL* ssl, int result, size_t byte_count,
+                      std::uint32_t* wait_events) {
+  if (result == 1) return byte_count;
+  switch (SSL_get_error(ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+      *wait_events = EPOLLIN;
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_WANT_WRITE:
+      *wait_events = EPOLLOUT;
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_ZERO_RETURN:  // close_notify
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      // an EOF without close_notify still ends the connection
+      if (errno == 0) return 0;
+      return -1;
+    default:
+      errno = EPROTO;
+      return -1;
+  }
+}
+
+}  // namespace
+
+TlsContext::TlsContext(const TlsOptions& options)
+    : context_(SSL_CTX_new(TLS_server_method())) {
+  if (context_ == nullptr) {
+    throw std::runtime_error("Failed to create TLS context: " +
+                             last_tls_error());
+  }
+  SSL_CTX_set_min_proto_version(context_, TLS1_2_VERSION);
+  SSL_CTX_set_options(context_, SSL_OP_NO_RENEGOTIATION |
+                                    SSL_OP_CIPHER_SERVER_PREFERENCE);
+  if (options.kernel_tls) SSL_CTX_set_options(context_, SSL_OP_ENABLE_KTLS);
+  // Writes behave like send(): they may be partial and resume from wherever
+  // the buffer is. Idle keep-alive connections give their buffers back.
+  SSL_CTX_set_mode(context_, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                 SSL_MODE_RELEASE_BUFFERS);
+  SSL_CTX_set_session_cache_mode(context_, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(context_, options.session_cache_size);
+  SSL_CTX_set_timeout(context_, options.session_timeout.count());
+  SSL_CTX_set_session_id_context(context_, kSessionIdContext,
+                                 sizeof(kSessionIdContext) - 1);
+
+  if (SSL_CTX_use_certificate_chain_file(
+          context_, options.certificate_file.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(context_, options.private_key_file.c_str(),
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(context_) != 1) {
+    std::string error = last_tls_error();
+    SSL_CTX_free(context_);
+    throw std::runtime_error("Failed to load TLS certificate " +
+                             options.certificate_file + ": " + error);
+  }
+}
+
+TlsContext::~TlsContext() { SSL_CTX_free(context_); }
+
+SSL* TlsContext::NewSession(int fd) const {
+  SSL* ssl = SSL_new(context_);
+  if (ssl == nullptr) return nullptr;
+  if (SSL_set_fd(ssl, fd) != 1) {
+    SSL_free(ssl);
+    return nullptr;
+  }
+  SSL_set_accept_state(ssl);
+  return ssl;
+}
+
+int tls_handshake(SSL* ssl, std::uint32_t* wait_events) {
+  ERR_clear_error();
+  int result = SSL_do_handshake(ssl);
+  if (result == 1) return 1;
+  switch (SSL_get_error(ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+      *wait_events = EPOLLIN;
+      return 0;
+    case SSL_ERROR_WANT_WRITE:
+      *wait_events = EPOLLOUT;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+ssize_t tls_recv(SSL* ssl, void* buffer, size_t length,
+                 std::uint32_t* wait_events) {
+  size_t byte_count = 0;
+  ERR_clear_error();
+  errno = 0;
+  int result = SSL_read_ex(ssl, buffer, length, &byte_count);
+  return finish_tls_io(ssl, result, byte_count, wait_events);
+}
+
+ssize_t tls_send(SSL* ssl, const void* buffer, size_t length,
+                 std::uint32_t* wait_events) {
+  size_t byte_count = 0;
+  ERR_clear_error();
+  errno = 0;
+  int result = SSL_write_ex(ssl, buffer, length, &byte_count);
+  ssize_t sent = finish_tls_io(ssl, result, byte_count, wait_events);
+  if (sent == 0 && length > 0) {  // the peer is gone
+    errno = EPIPE;
+    return -1;
+  }
+  return sent;
+}
+
+bool tls_pending(SSL* ssl) { return SSL_pending(ssl) > 0; }
+
+void tls_shutdown(SSL* ssl) {
+  ERR_clear_error();
+  SSL_shutdown(ssl);
+}
+
+bool tls_kernel_send(SSL* ssl) {
+  return BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,78 @@
+// Defines TLS termination on top of OpenSSL. Handshakes, reads and writes
+// never block, so TLS connections are driven by the same epoll loop as
+// plaintext ones.
+
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <openssl/ssl.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace simple_http_server {
+
+struct TlsOptions {
+  TlsOptions()
+      : kernel_tls(true),
+        session_cache_size(20480),
+        session_timeout(std::chrono::seconds(300)) {}
+  // PEM files of the certificate chain and of its private key
+  std::string certificate_file;
+  std::string private_key_file;
+  // Hands encryption over to the kernel after the handshake when it
+  // supports kTLS for the negotiated cipher, so that sends skip the copy
+  // through OpenSSL buffers
+  bool kernel_tls;
+  // Sessions kept for resumption by session ID. TLS 1.3 clients resume
+  // with session tickets instead, which need no server state.
+  long session_cache_size;
+  std::chrono::seconds session_timeout;
+};
+
+// Server-side TLS configuration shared by all connections of a listener
+class TlsContext {
+ public:
+  // Throws std::runtime_error when the certificate or key cannot be loaded
+  explicit TlsContext(const TlsOptions& options);
+  ~TlsContext();
+  TlsContext(const TlsContext&) = delete;
+  TlsContext& operator=(const TlsContext&) = delete;
+
+  // A session for an accepted connection, or nullptr on failure
+  SSL* NewSession(int fd) const;
+
+ private:
+  SSL_CTX* context_;
+};
+
+// Drives the handshake of a session. Returns 1 once it is complete, 0 when
+// it has to wait for the socket to be ready for `*wait_events`, and -1 when
+// it failed.
+int tls_handshake(SSL* ssl, std::uint32_t* wait_events);
+
+// Counterparts of recv() and send(): they return the number of bytes read or
+// written, 0 when the peer closed the session, or -1 with errno set. When
+// errno is EAGAIN, the operation must be retried once the socket is ready
+// for `*wait_events`, which can differ from the operation itself.
+ssize_t tls_recv(SSL* ssl, void* buffer, size_t length,
+                 std::uint32_t* wait_events);
+ssize_t tls_send(SSL* ssl, const void* buffer, size_t length,
+                 std::uint32_t* wait_events);
+
+// Whether decrypted input is buffered in the session, which epoll cannot see
+bool tls_pending(SSL* ssl);
+
+// Sends close_notify without waiting for the peer's
+void tls_shutdown(SSL* ssl);
+
+// Whether records are encrypted by the kernel on the send path. Plaintext
+// can then be written to the socket directly, for example with sendmsg().
+bool tls_kernel_send(SSL* ssl);
+
+}  // namespace simple_http_server
+
+#endif  // TLS_H_
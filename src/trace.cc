@@ -0,0 +1,122 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+
+namespace simple_http_server {
+
+namespace {
+
+// Name of the part of a request that ends at each phase
+const char* const kPhaseNames[kTracePhaseCount] = {
+    "accept", "dispatch", "wait", "parse", "handler", "serialize", "send"};
+
+// Shortest interval used to measure the frequency of the counter
+constexpr std::chrono::milliseconds kCalibrationTime(10);
+
+void write_event(std::ostream& out, const char* name, double start,
+                 double duration, int tid, int fd) {
+  out << ",\n{\"name\":\"" << name << "\",\"cat\":\"request\",\"ph\":\"X\","
+      << "\"ts\":" << start << ",\"dur\":" << duration
+      << ",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"fd\":" << fd << "}}";
+}
+
+}  // namespace
+
+Tracer::Tracer(size_t worker_count, size_t spans_per_worker)
+    : start_ticks_(trace_clock()),
+      start_time_(std::chrono::steady_clock::now()) {
+  for (size_t i = 0; i < worker_count; i++) {
+    rings_.emplace_back(new Ring(spans_per_worker));
+  }
+}
+
+void Tracer::Commit(size_t worker, const TraceSpan& span) {
+  Ring& ring = *rings_[worker];
+  Slot& slot = ring.slots[ring.next];
+  std::uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+
+  ring.next = ring.next + 1 == ring.capacity ? 0 : ring.next + 1;
+  slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < kTracePhaseCount; i++) {
+    slot.timestamps[i].store(span.timestamps[i], std::memory_order_relaxed);
+  }
+  slot.fd.store(span.fd, std::memory_order_relaxed);
+  slot.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+double Tracer::TicksPerMicrosecond() const {
+#if defined(__x86_64__) || defined(__i386__)
+  auto elapsed = std::chrono::steady_clock::now() - start_time_;
+  if (elapsed < kCalibrationTime) {
+    std::this_thread::sleep_for(kCalibrationTime - elapsed);
+  }
+  std::uint64_t ticks = trace_clock() - start_ticks_;
+  std::chrono::duration<double, std::micro> time =
+      std::chrono::steady_clock::now() - start_time_;
+  return ticks / time.count();
+#else
+  return 1000.0;  // trace_clock() counts nanoseconds
+#endif
+}
+
+void Tracer::WriteChromeTrace(std::ostream& out) const {
+  double ticks_per_us = TicksPerMicrosecond();
+  auto to_us = [&](std::uint64_t ticks) {
+    return static_cast<std::int64_t>(ticks - start_ticks_) / ticks_per_us;
+  };
+
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+      << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+      << "\"args\":{\"name\":\"listener\"}}";
+  for (size_t worker = 0; worker < rings_.size(); worker++) {
+    out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+        << worker + 1 << ",\"args\":{\"name\":\"worker " << worker << "\"}}";
+  }
+
+  for (size_t worker = 0; worker < rings_.size(); worker++) {
+    const Ring& ring = *rings_[worker];
+    for (size_t i = 0; i < ring.capacity; i++) {
+      const Slot& slot = ring.slots[i];
+      TraceSpan span;
+      std::uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+      if (sequence == 0 || (sequence & 1)) continue;
+      for (size_t phase = 0; phase < kTracePhaseCount; phase++) {
+        span.timestamps[phase] =
+            slot.timestamps[phase].load(std::memory_order_relaxed);
+      }
+      span.fd = slot.fd.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+      const std::uint64_t* ts = span.timestamps;
+      size_t received = static_cast<size_t>(TracePhase::kReceived);
+      size_t sent = static_cast<size_t>(TracePhase::kSent);
+      if (ts[received] != 0 && ts[sent] != 0) {
+        write_event(out, "request", to_us(ts[received]),
+                    to_us(ts[sent]) - to_us(ts[received]), worker + 1,
+                    span.fd);
+      }
+      // each phase closes the part of the request that started at the
+      // previous phase the request went through
+      size_t dispatched = static_cast<size_t>(TracePhase::kDispatched);
+      size_t previous = kTracePhaseCount;
+      for (size_t phase = 0; phase < kTracePhaseCount; phase++) {
+        if (ts[phase] == 0) continue;
+        if (previous != kTracePhaseCount) {
+          write_event(out, kPhaseNames[phase], to_us(ts[previous]),
+                      to_us(ts[phase]) - to_us(ts[previous]),
+                      phase == dispatched ? 0 : worker + 1, span.fd);
+        }
+        previous = phase;
+      }
+    }
+  }
+  out << "\n]}\n";
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,119 @@
+// Defines request tracing: the server timestamps each phase of a request
+// with the CPU timestamp counter, keeps the latest requests of each worker
+// in a ring buffer, and dumps them as Chrome trace events on demand.
+//
+// The hooks are macros that compile to nothing unless the server is built
+// with SIMPLE_HTTP_SERVER_TRACING defined (cmake -DENABLE_TRACING=ON).
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace simple_http_server {
+
+// Points in the life of a request, in order. The first two only apply to
+// the first request of a connection.
+enum class TracePhase {
+  kAccepted,    // the listener accepted the connection
+  kDispatched,  // the connection was added to a worker epoll instance
+  kReceived,    // the request was read
+  kParsed,
+  kHandled,     // the request handler returned
+  kSerialized,  // the response was written to the connection buffer
+  kSent,        // the last byte of the response was sent
+  kCount
+};
+
+constexpr size_t kTracePhaseCount = static_cast<size_t>(TracePhase::kCount);
+
+// Ticks of the timestamp counter, or nanoseconds where there is none. The
+// counter is assumed to be invariant and synchronized across cores.
+inline std::uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Timestamps of one request, 0 for the phases it did not go through
+struct TraceSpan {
+  TraceSpan() : timestamps(), fd(-1) {}
+  void Reset() {
+    for (auto& timestamp : timestamps) timestamp = 0;
+  }
+  std::uint64_t timestamps[kTracePhaseCount];
+  int fd;
+};
+
+// Keeps the last spans committed by each worker. Workers never block, and
+// the trace can be written by any thread while they run.
+class Tracer {
+ public:
+  Tracer(size_t worker_count, size_t spans_per_worker);
+
+  // Called by worker `worker` only
+  void Commit(size_t worker, const TraceSpan& span);
+
+  // Writes the buffered spans in the Chrome trace event format, which can be
+  // loaded in chrome://tracing or https://ui.perfetto.dev
+  void WriteChromeTrace(std::ostream& out) const;
+
+ private:
+  // A span guarded by a sequence number that is odd while it is written, so
+  // that a reader can detect and skip a span overwritten under its feet
+  struct Slot {
+    std::atomic<std::uint64_t> sequence;
+    std::atomic<std::uint64_t> timestamps[kTracePhaseCount];
+    std::atomic<int> fd;
+  };
+  struct Ring {
+    explicit Ring(size_t capacity)
+        : slots(new Slot[capacity]()), capacity(capacity), next(0) {}
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity;
+    size_t next;  // only touched by the worker
+  };
+
+  std::vector<std::unique_ptr<Ring>> rings_;
+  // Reference points to convert counter ticks to microseconds
+  std::uint64_t start_ticks_;
+  std::chrono::steady_clock::time_point start_time_;
+
+  double TicksPerMicrosecond() const;
+};
+
+}  // namespace simple_http_server
+
+#ifdef SIMPLE_HTTP_SERVER_TRACING
+#define TRACE_NOW(name) const std::uint64_t name = trace_clock()
+#define TRACE_PHASE_AT(span, phase, timestamp) \
+  ((span).timestamps[static_cast<size_t>(TracePhase::phase)] = (timestamp))
+#define TRACE_PHASE(span, phase) TRACE_PHASE_AT(span, phase, trace_clock())
+#define TRACE_COMMIT(tracer, worker, span, fd_) \
+  do {                                          \
+    (span).fd = (fd_);                          \
+    (tracer)->Commit(worker, span);             \
+    (span).Reset();                             \
+  } while (0)
+#else
+#define TRACE_NOW(name)
+#define TRACE_PHASE_AT(span, phase, timestamp) ((void)0)
+#define TRACE_PHASE(span, phase) ((void)0)
+#define TRACE_COMMIT(tracer, worker, span, fd_) ((void)0)
+#endif
+
+#endif  // TRACE_H_
@@ -43,7 +43,7 @@ class Uri {
 
   void SetPathToLowercase() {
     std::transform(path_.begin(), path_.end(), path_.begin(),
-                   [](char c) { return tolower(c); });
+                   [](unsigned char c) { return tolower(c); });
   }
 };
 
@@ -0,0 +1,312 @@
+#include "websocket.h"
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "http_message.h"
+
+namespace simple_http_server {
+
+namespace {
+
+const char kWebSocketGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+bool is_control_opcode(WebSocketOpcode opcode) {
+  return (static_cast<std::uint8_t>(opcode) & 0x8) != 0;
+}
+
+bool is_valid_opcode(std::uint8_t opcode) {
+  return opcode <= 0x2 || (opcode >= 0x8 && opcode <= 0xA);
+}
+
+// Size of a client frame header, which always carries a masking key, given
+// its first two bytes
+size_t websocket_header_size(const unsigned char* header) {
+  switch (header[1] & 0x7F) {
+    case 126:
+      return 2 + 2 + 4;
+    case 127:
+      return 2 + 8 + 4;
+    default:
+      return 2 + 4;
+  }
+}
+
+}  // namespace
+
+bool is_websocket_upgrade(const HttpRequest& request) {
+  return request.method() == HttpMethod::GET &&
+         has_header_token(request.header("Upgrade"), "websocket") &&
+         has_header_token(request.header("Connection"), "upgrade");
+}
+
+std::string websocket_accept_key(const std::string& key) {
+  std::string input = key + kWebSocketGuid;
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  unsigned char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+
+  SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.length(),
+       digest);
+  int length = EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+  return std::string(reinterpret_cast<const char*>(encoded), length);
+}
+
+std::string encode_websocket_frame(WebSocketOpcode opcode,
+                                   const std::string& payload) {
+  std::string frame;
+  size_t length = payload.length();
+
+  frame.reserve(length + 10);
+  frame.push_back(static_cast<char>(0x80 | static_cast<std::uint8_t>(opcode)));
+  if (length < 126) {
+    frame.push_back(static_cast<char>(length));
+  } else if (length <= 0xFFFF) {
+    frame.push_back(126);
+    frame.push_back(static_cast<char>(length >> 8));
+    frame.push_back(static_cast<char>(length));
+  } else {
+    frame.push_back(127);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      frame.push_back(static_cast<char>(length >> shift));
+    }
+  }
+  frame.append(payload);
+  return frame;
+}
+
+void unmask_websocket_payload(char* data, size_t length,
+                              const unsigned char mask[4], size_t offset) {
+  unsigned char key[4];
+  std::uint32_t pattern;
+  size_t i = 0;
+
+  // Rotate the key so that key[0] applies to data[0]. Every block below is
+  // a multiple of 4 bytes, so the same pattern applies to all of them.
+  for (int k = 0; k < 4; k++) key[k] = mask[(offset + k) & 3];
+  memcpy(&pattern, key, sizeof(pattern));
+
+#if defined(__AVX2__)
+  const __m256i pattern256 = _mm256_set1_epi32(pattern);
+  for (; i + 32 <= length; i += 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i*>(data + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i),
+                        _mm256_xor_si256(block, pattern256));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i pattern128 = _mm_set1_epi32(pattern);
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<__m128i*>(data + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i),
+                     _mm_xor_si128(block, pattern128));
+  }
+#endif
+  const std::uint64_t pattern64 =
+      (static_cast<std::uint64_t>(pattern) << 32) | pattern;
+  for (; i + 8 <= length; i += 8) {
+    std::uint64_t block;
+    memcpy(&block, data + i, sizeof(block));
+    block ^= pattern64;
+    memcpy(data + i, &block, sizeof(block));
+  }
+  for (; i < length; i++) {
+    data[i] ^= key[i & 3];
+  }
+}
+
+WebSocketParser::WebSocketParser()
+    : state_(State::kHeader),
+      header_(),
+      header_length_(0),
+      fin_(false),
+      opcode_(WebSocketOpcode::kContinuation),
+      mask_(),
+      remaining_(0),
+      payload_offset_(0),
+      message_opcode_(WebSocketOpcode::kContinuation) {}
+
+void WebSocketParser::Feed(const char* data, size_t length,
+                           const Sink& sink) {
+  while (length > 0) {
+    if (state_ == State::kHeader) {
+      size_t needed =
+          header_length_ < 2 ? 2 : websocket_header_size(header_);
+      size_t n = std::min(needed - header_length_, length);
+      memcpy(header_ + header_length_, data, n);
+      header_length_ += n;
+      data += n;
+      length -= n;
+      if (!ParseHeader()) continue;
+      if (remaining_ == 0) {
+        FinishFrame(sink);
+      } else {
+        state_ = State::kPayload;
+      }
+      continue;
+    }
+
+    // Payload bytes are unmasked in place as they arrive, straight into the
+    // message being reassembled
+    std::string& target = is_control_opcode(opcode_) ? control_ : message_;
+    size_t n = std::min<std::uint64_t>(remaining_, length);
+    size_t start = target.length();
+    target.append(data, n);
+    unmask_websocket_payload(&target[start], n, mask_, payload_offset_);
+    payload_offset_ += n;
+    remaining_ -= n;
+    data += n;
+    length -= n;
+    if (remaining_ == 0) FinishFrame(sink);
+  }
+}
+
+bool WebSocketParser::ParseHeader() {
+  if (header_length_ < 2) return false;
+
+  // the first two bytes are checked before waiting for the rest
+  std::uint8_t opcode = header_[0] & 0x0F;
+  std::uint64_t length = header_[1] & 0x7F;
+  size_t position = 2;
+  if (header_[0] & 0x70) {
+    throw std::invalid_argument("WebSocket extensions are not supported");
+  }
+  if (!is_valid_opcode(opcode)) {
+    throw std::invalid_argument("Unknown WebSocket opcode");
+  }
+  if (!(header_[1] & 0x80)) {
+    throw std::invalid_argument("Client WebSocket frames must be masked");
+  }
+  if (header_length_ < websocket_header_size(header_)) return false;
+
+  if (length >= 126) {
+    size_t bytes = length == 126 ? 2 : 8;
+    length = 0;
+    for (size_t i = 0; i < bytes; i++) {
+      length = (length << 8) | header_[position++];
+    }
+  }
+  memcpy(mask_, header_ + position, sizeof(mask_));
+
+  fin_ = header_[0] & 0x80;
+  opcode_ = static_cast<WebSocketOpcode>(opcode);
+  if (is_control_opcode(opcode_)) {
+    if (!fin_ || length > 125) {
+      throw std::invalid_argument("Invalid WebSocket control frame");
+    }
+    control_.clear();
+  } else {
+    bool continuation = opcode_ == WebSocketOpcode::kContinuation;
+    bool in_message = message_opcode_ != WebSocketOpcode::kContinuation;
+    if (continuation != in_message) {
+      throw std::invalid_argument("Unexpected WebSocket message fragment");
+    }
+    if (length > kMaxWebSocketMessageSize - message_.length()) {
+      throw std::length_error("WebSocket message too large");
+    }
+    if (!continuation) message_opcode_ = opcode_;
+  }
+  remaining_ = length;
+  payload_offset_ = 0;
+  header_length_ = 0;
+  return true;
+}
+
+void WebSocketParser::FinishFrame(const Sink& sink) {
+  state_ = State::kHeader;
+  if (is_control_opcode(opcode_)) {
+    sink(opcode_, control_);
+  } else if (fin_) {
+    sink(message_opcode_, message_);
+    message_.clear();
+    message_opcode_ = WebSocketOpcode::kContinuation;
+  }
+}
+
+WebSocketSession::WebSocketSession(const WebSocketRoute* route)
+    : route_(route),
+      send_offset_(0),
+      queued_bytes_(0),
+      close_sent_(false),
+      close_received_(false),
+      overflowed_(false),
+      write_blocked_(false) {}
+
+void WebSocketSession::Send(WebSocketOpcode opcode,
+                            const std::string& payload) {
+  if (close_sent_) return;
+  Enqueue(std::make_shared<const std::string>(
+      encode_websocket_frame(opcode, payload)));
+}
+
+void WebSocketSession::Close(WebSocketCloseCode code) {
+  if (close_sent_) return;
+  std::uint16_t status = static_cast<std::uint16_t>(code);
+  std::string payload;
+  payload.push_back(static_cast<char>(status >> 8));
+  payload.push_back(static_cast<char>(status));
+  Send(WebSocketOpcode::kClose, payload);
+  close_sent_ = true;
+}
+
+void WebSocketSession::Enqueue(std::shared_ptr<const std::string> frame) {
+  if (overflowed_) return;
+  if (queued_bytes_ + frame->length() > kMaxWebSocketSendQueue) {
+    overflowed_ = true;
+    return;
+  }
+  queued_bytes_ += frame->length();
+  send_queue_.push_back(std::move(frame));
+}
+
+void WebSocketSession::Consume(size_t byte_count) {
+  queued_bytes_ -= byte_count;
+  while (byte_count > 0) {
+    size_t left = send_queue_.front()->length() - send_offset_;
+    if (byte_count < left) {
+      send_offset_ += byte_count;
+      return;
+    }
+    byte_count -= left;
+    send_offset_ = 0;
+    send_queue_.pop_front();
+  }
+}
+
+void WebSocketSession::Receive(const char* data, size_t length) {
+  parser_.Feed(data, length, [this](WebSocketOpcode opcode,
+                                    const std::string& payload) {
+    if (close_received_) return;  // nothing is expected after a close frame
+    switch (opcode) {
+      case WebSocketOpcode::kPing:
+        Send(WebSocketOpcode::kPong, payload);
+        break;
+      case WebSocketOpcode::kPong:
+        break;
+      case WebSocketOpcode::kClose:
+        // echo the status code, which completes the closing handshake
+        close_received_ = true;
+        if (!close_sent_) {
+          Send(WebSocketOpcode::kClose, payload.substr(0, 2));
+          close_sent_ = true;
+        }
+        break;
+      default:
+        if (route_->handler.on_message) {
+          route_->handler.on_message(*this, opcode, payload);
+        }
+    }
+  });
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,155 @@
+// Defines WebSocket sessions (RFC 6455): the opening handshake, incremental
+// frame parsing and the queue of frames waiting to be sent. Sessions are
+// driven by the worker epoll loops of the server like HTTP connections.
+
+#ifndef WEBSOCKET_H_
+#define WEBSOCKET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "http_message.h"
+
+namespace simple_http_server {
+
+// A message larger than this closes the session with status 1009
+constexpr size_t kMaxWebSocketMessageSize = 1 << 20;
+
+// A session whose peer cannot keep up with this many queued bytes is dropped
+constexpr size_t kMaxWebSocketSendQueue = 1 << 22;
+
+// Queued frames written by a single system call
+constexpr size_t kMaxWebSocketIovecs = 64;
+
+enum class WebSocketOpcode : std::uint8_t {
+  kContinuation = 0x0,
+  kText = 0x1,
+  kBinary = 0x2,
+  kClose = 0x8,
+  kPing = 0x9,
+  kPong = 0xA
+};
+
+// Status codes sent in close frames
+enum class WebSocketCloseCode : std::uint16_t {
+  kNormal = 1000,
+  kGoingAway = 1001,
+  kProtocolError = 1002,
+  kMessageTooBig = 1009,
+  kInternalError = 1011
+};
+
+// Whether the request asks to switch to the WebSocket protocol
+bool is_websocket_upgrade(const HttpRequest& request);
+
+// Value of Sec-WebSocket-Accept for the client's Sec-WebSocket-Key
+std::string websocket_accept_key(const std::string& key);
+
+// A complete unmasked frame as sent by the server
+std::string encode_websocket_frame(WebSocketOpcode opcode,
+                                   const std::string& payload);
+
+// XORs `length` bytes with the 4-byte masking key, starting at position
+// `offset` of the frame payload so that a payload can be unmasked piecewise
+void unmask_websocket_payload(char* data, size_t length,
+                              const unsigned char mask[4], size_t offset);
+
+// Parses the frames sent by a client as their bytes arrive, and reassembles
+// fragmented messages. Control frames may arrive between the fragments.
+class WebSocketParser {
+ public:
+  // Called with each complete message or control frame
+  using Sink = std::function<void(WebSocketOpcode, const std::string&)>;
+
+  WebSocketParser();
+
+  // Throws std::length_error when a message is too large, and
+  // std::invalid_argument on any other protocol violation
+  void Feed(const char* data, size_t length, const Sink& sink);
+
+ private:
+  enum class State { kHeader, kPayload };
+
+  State state_;
+  // the header is at most 14 bytes, and may arrive in several pieces
+  unsigned char header_[14];
+  size_t header_length_;
+  bool fin_;
+  WebSocketOpcode opcode_;
+  unsigned char mask_[4];
+  std::uint64_t remaining_;
+  size_t payload_offset_;
+  // opcode of the message being reassembled, kContinuation when none
+  WebSocketOpcode message_opcode_;
+  std::string message_;
+  std::string control_;
+
+  // Returns false until the whole header has been buffered
+  bool ParseHeader();
+  void FinishFrame(const Sink& sink);
+};
+
+class WebSocketSession;
+
+// Callbacks of a WebSocket route. They run on the worker thread that owns
+// the session, which is the only thread allowed to call Send() or Close().
+// With an external event loop, that is the thread polling the worker, and
+// Stop() polls the workers itself while it drains.
+struct WebSocketHandler {
+  std::function<void(WebSocketSession&)> on_open;
+  std::function<void(WebSocketSession&, WebSocketOpcode, const std::string&)>
+      on_message;
+  std::function<void(WebSocketSession&)> on_close;
+};
+
+struct WebSocketRoute {
+  std::string path;
+  WebSocketHandler handler;
+};
+
+// A connection that has switched to the WebSocket protocol. Outgoing frames
+// are queued and written by the server when the socket is writable; frames
+// shared by many sessions, such as broadcasts, are encoded only once.
+class WebSocketSession {
+ public:
+  explicit WebSocketSession(const WebSocketRoute* route);
+
+  void Send(WebSocketOpcode opcode, const std::string& payload);
+  void SendText(const std::string& payload) {
+    Send(WebSocketOpcode::kText, payload);
+  }
+  // Starts the closing handshake, nothing can be sent afterwards
+  void Close(WebSocketCloseCode code = WebSocketCloseCode::kNormal);
+
+  const std::string& path() const { return route_->path; }
+  bool closing() const { return close_sent_; }
+
+ private:
+  friend class HttpServer;
+
+  const WebSocketRoute* route_;
+  WebSocketParser parser_;
+  std::deque<std::shared_ptr<const std::string>> send_queue_;
+  // bytes of the first queued frame that have already been sent
+  size_t send_offset_;
+  size_t queued_bytes_;
+  bool close_sent_;
+  bool close_received_;
+  bool overflowed_;
+  // whether the server waits for the socket to become writable
+  bool write_blocked_;
+
+  void Enqueue(std::shared_ptr<const std::string> frame);
+  // Removes `byte_count` sent bytes from the front of the queue
+  void Consume(size_t byte_count);
+  // Parses received bytes, answers control frames and calls the handler
+  void Receive(const char* data, size_t length);
+};
+
+}  // namespace simple_http_server
+
+#endif  // WEBSOCKET_H_
@@ -0,0 +1,58 @@
+#include "worker_distribution.h"
+
+#include <chrono>
+
+namespace simple_http_server {
+
+WorkerDistributor::WorkerDistributor()
+    : policy_(DistributionPolicy::kRoundRobin),
+      next_(0),
+      rng_(std::chrono::steady_clock::now().time_since_epoch().count()) {}
+
+int WorkerDistributor::Pick(const WorkerLoad* loads, int worker_count) {
+  if (worker_count == 1) return 0;
+  int start = next_;
+  next_ = next_ + 1 >= worker_count ? 0 : next_ + 1;
+
+  switch (policy_) {
+    case DistributionPolicy::kLeastConnections: {
+      // start from a rotating position so that ties are spread evenly
+      int picked = start;
+      int lowest = loads[start].value();
+      for (int i = 1; i < worker_count && lowest > 0; i++) {
+        int worker = (start + i) % worker_count;
+        int load = loads[worker].value();
+        if (load < lowest) {
+          picked = worker;
+          lowest = load;
+        }
+      }
+      return picked;
+    }
+    case DistributionPolicy::kPowerOfTwoChoices: {
+      int first = rng_() % worker_count;
+      int second = rng_() % (worker_count - 1);
+      if (second >= first) second++;  // two distinct workers
+      return loads[second].value() < loads[first].value() ? second : first;
+    }
+    default:
+      return start;
+  }
+}
+
+int least_connected_worker(const WorkerLoad* loads, int worker_count,
+                           int excluded) {
+  int picked = -1;
+  int lowest = 0;
+  for (int worker = 0; worker < worker_count; worker++) {
+    if (worker == excluded) continue;
+    int connections = loads[worker].connections.load(std::memory_order_relaxed);
+    if (picked < 0 || connections < lowest) {
+      picked = worker;
+      lowest = connections;
+    }
+  }
+  return picked;
+}
+
+}  // namespace simple_http_server
@@ -0,0 +1,84 @@
+// Defines how the listener spreads new connections among the workers, and
+// the load figures of each worker the policies rely on
+
+#ifndef WORKER_DISTRIBUTION_H_
+#define WORKER_DISTRIBUTION_H_
+
+#include <atomic>
+#include <chrono>
+#include <random>
+
+namespace simple_http_server {
+
+// How often a worker compares its load with the others when idle
+// connections may migrate
+constexpr std::chrono::milliseconds kRebalanceInterval(100);
+
+// Connections a worker hands over in one rebalancing round at most
+constexpr int kMaxMigrationsPerRound = 64;
+
+enum class DistributionPolicy {
+  kRoundRobin,
+  // the worker with the least load, ties going to each worker in turn
+  kLeastConnections,
+  // the least loaded of two workers picked at random, which is nearly as
+  // good as kLeastConnections but only reads two gauges
+  kPowerOfTwoChoices
+};
+
+struct DistributionOptions {
+  DistributionOptions()
+      : policy(DistributionPolicy::kRoundRobin),
+        migrate_idle_connections(false),
+        migration_threshold(16) {}
+  DistributionPolicy policy;
+  // Lets a worker hand idle keep-alive connections over to the least loaded
+  // worker, so that load evens out when long-lived clients pile up on a few
+  // workers. Connections that are being served never move.
+  bool migrate_idle_connections;
+  // Difference in connections with the least loaded worker above which a
+  // worker migrates half of it
+  int migration_threshold;
+};
+
+// Load of a worker, updated by the worker and by the listener as
+// connections come and go, on its own cache line so that the workers do not
+// slow each other down
+struct alignas(64) WorkerLoad {
+  WorkerLoad() : connections(0), ready_events(0) {}
+  // client connections owned by the worker
+  std::atomic<int> connections;
+  // events returned by its last epoll_wait, 0 when it found none
+  std::atomic<int> ready_events;
+
+  int value() const {
+    return connections.load(std::memory_order_relaxed) +
+           ready_events.load(std::memory_order_relaxed);
+  }
+};
+
+// Picks the worker each new connection goes to. Used by the listener
+// thread only.
+class WorkerDistributor {
+ public:
+  WorkerDistributor();
+  ~WorkerDistributor() = default;
+
+  void SetPolicy(DistributionPolicy policy) { policy_ = policy; }
+  int Pick(const WorkerLoad* loads, int worker_count);
+
+  DistributionPolicy policy() const { return policy_; }
+
+ private:
+  DistributionPolicy policy_;
+  int next_;
+  std::minstd_rand rng_;
+};
+
+// The worker with the fewest connections, other than `excluded`
+int least_connected_worker(const WorkerLoad* loads, int worker_count,
+                           int excluded);
+
+}  // namespace simple_http_server
+
+#endif  // WORKER_DISTRIBUTION_H_
@@ -1,13 +1,45 @@
 // Simple unit tests without using any framework
 
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <iterator>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "access_log.h"
+#include "admission_control.h"
+#include "content_bundle.h"
 #include "http_message.h"
+#include "http_server.h"
+#include "listener_handoff.h"
+#include "prefork_server.h"
+#include "reverse_proxy.h"
+#include "tls.h"
+#include "trace.h"
+#include "websocket.h"
+#include "worker_distribution.h"
 #include "uri.h"
 
 using namespace simple_http_server;
@@ -79,6 +111,1410 @@ void test_response_to_string() {
   EXPECT_TRUE(to_string(response) == expected_str);
 }
 
+void test_string_to_request_version() {
+  HttpRequest request = string_to_request("GET / HTTP/1.0\r\n\r\n");
+  EXPECT_TRUE(request.version() == HttpVersion::HTTP_1_0);
+
+  bool rejected = false;
+  try {
+    string_to_request("GET / HTTP/2.0\r\n\r\n");
+  } catch (const std::invalid_argument& e) {
+  } catch (const std::logic_error& e) {
+    rejected = true;
+  }
+  EXPECT_TRUE(rejected);
+}
+
+void test_string_to_request_header_fields() {
+  HttpRequest request = string_to_request(
+      "GET / HTTP/1.1\r\nUser-Agent:  curl/8.0 (x86_64 linux) \t\r\n"
+      "X-Empty:\r\n\r\n");
+  EXPECT_TRUE(request.header("User-Agent") == "curl/8.0 (x86_64 linux)");
+  EXPECT_TRUE(request.headers().count("X-Empty") == 1);
+  EXPECT_TRUE(request.header("X-Empty").empty());
+
+  // the body may directly follow the start line
+  request = string_to_request("POST / HTTP/1.1\r\n\r\nbody");
+  EXPECT_TRUE(request.content() == "body");
+  EXPECT_TRUE(request.header("Content-Length") == "4");
+
+  for (const char* invalid : {"GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+                              "GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+                              "GET / HTTP/1.1\r\nHost : x\r\n\r\n",
+                              "GET / HTTP/1.1\r\n: x\r\n\r\n"}) {
+    bool rejected = false;
+    try {
+      string_to_request(invalid);
+    } catch (const std::invalid_argument& e) {
+      rejected = true;
+    }
+    EXPECT_TRUE(rejected);
+  }
+}
+
+void test_persistent_connection() {
+  HttpRequest request;
+  EXPECT_TRUE(is_persistent_connection(request));
+  request.SetHeader("connection", "Close");
+  EXPECT_TRUE(!is_persistent_connection(request));
+  EXPECT_TRUE(request.header("Connection") == "Close");
+
+  request.SetVersion(HttpVersion::HTTP_1_0);
+  request.RemoveHeader("Connection");
+  EXPECT_TRUE(!is_persistent_connection(request));
+  request.SetHeader("Connection", "Keep-Alive");
+  EXPECT_TRUE(is_persistent_connection(request));
+  request.SetHeader("Connection", "keep-alive, close");
+  EXPECT_TRUE(!is_persistent_connection(request));
+}
+
+void test_pass_file_descriptors() {
+  int channel[2], pipe_fds[2];
+  EXPECT_TRUE(socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == 0);
+  EXPECT_TRUE(pipe(pipe_fds) == 0);
+
+  send_file_descriptors(channel[0], {pipe_fds[1]});
+  std::vector<int> received = receive_file_descriptors(channel[1]);
+  EXPECT_TRUE(received.size() == 1);
+
+  // the received descriptor refers to the same pipe
+  char c = 0;
+  EXPECT_TRUE(write(received[0], "x", 1) == 1);
+  EXPECT_TRUE(read(pipe_fds[0], &c, 1) == 1 && c == 'x');
+
+  for (int fd : received) close(fd);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  close(channel[0]);
+  close(channel[1]);
+}
+
+void test_token_bucket() {
+  TokenBucket bucket(10, 3);  // 10 requests per second, bursts of 3
+  auto now = std::chrono::steady_clock::now();
+  EXPECT_TRUE(bucket.TryAcquire(now));
+  EXPECT_TRUE(bucket.TryAcquire(now));
+  EXPECT_TRUE(bucket.TryAcquire(now));
+  EXPECT_TRUE(!bucket.TryAcquire(now));
+  EXPECT_TRUE(bucket.TryAcquire(now + std::chrono::milliseconds(100)));
+  EXPECT_TRUE(!bucket.TryAcquire(now + std::chrono::milliseconds(100)));
+}
+
+void test_admission_controller() {
+  AdmissionPolicy policy;
+  policy.max_connections = 3;
+  policy.max_connections_per_client = 2;
+  AdmissionController admission;
+  admission.SetPolicy(policy);
+
+  EXPECT_TRUE(admission.AdmitConnection(1) == HttpStatusCode::Ok);
+  EXPECT_TRUE(admission.AdmitConnection(1) == HttpStatusCode::Ok);
+  EXPECT_TRUE(admission.AdmitConnection(1) ==
+              HttpStatusCode::TooManyRequests);
+  EXPECT_TRUE(admission.AdmitConnection(2) == HttpStatusCode::Ok);
+  EXPECT_TRUE(admission.AdmitConnection(3) ==
+              HttpStatusCode::ServiceUnvailable);
+  admission.ReleaseConnection(1);
+  EXPECT_TRUE(admission.connection_count() == 2);
+  EXPECT_TRUE(admission.AdmitConnection(3) == HttpStatusCode::Ok);
+
+  admission.SetRouteRateLimit(Uri("/limited"), 1, 1);
+  EXPECT_TRUE(admission.AdmitRequest(Uri("/limited")));
+  EXPECT_TRUE(!admission.AdmitRequest(Uri("/limited")));
+  EXPECT_TRUE(admission.AdmitRequest(Uri("/")));
+}
+
+void test_response_framer() {
+  ResponseFramer framer;
+  std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhelloXX";
+  // feed the response in pieces that split the header terminator
+  EXPECT_TRUE(framer.Feed(response.data(), 20) == 20);
+  EXPECT_TRUE(!framer.complete());
+  EXPECT_TRUE(framer.Feed(response.data() + 20, response.length() - 20) ==
+              response.length() - 22);
+  EXPECT_TRUE(framer.complete() && framer.reusable());
+
+  framer.Reset(false);
+  response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+             "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+  for (char c : response) framer.Feed(&c, 1);
+  EXPECT_TRUE(framer.complete() && framer.reusable());
+
+  framer.Reset(true);
+  response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n";
+  framer.Feed(response.data(), response.length());
+  EXPECT_TRUE(framer.complete());
+
+  framer.Reset(false);
+  response = "HTTP/1.0 200 OK\r\n\r\nbody";
+  framer.Feed(response.data(), response.length());
+  EXPECT_TRUE(!framer.complete());
+  framer.FeedEof();
+  EXPECT_TRUE(framer.complete() && !framer.reusable());
+
+  // Connection options are matched as whole tokens, and bytes above 0x7f in
+  // the header section are relayed as they are
+  framer.Reset(false);
+  response = "HTTP/1.1 200 OK\r\nConnection: keep-alive, closed\r\n"
+             "X-Name: \xc3\xa9\xff\r\nContent-Length: 2\r\n\r\nok";
+  framer.Feed(response.data(), response.length());
+  EXPECT_TRUE(framer.complete() && framer.reusable());
+
+  // hop-by-hop fields are removed from the relayed header section, and the
+  // body is relayed as is
+  framer.Reset(false, "Keep-Alive");
+  response = "HTTP/1.1 200 OK\r\nConnection: close, X-Hop\r\n"
+             "X-Hop: 1\r\n  folded\r\nKeep-Alive: timeout=5\r\n"
+             "Proxy-Authenticate: Basic\r\nContent-Length: 5\r\n\r\nhello";
+  std::string output;
+  for (size_t i = 0; i < response.length(); i += 7) {
+    framer.Feed(response.data() + i, std::min<size_t>(7, response.length() - i),
+                &output);
+  }
+  EXPECT_TRUE(framer.complete() && !framer.reusable());
+  EXPECT_TRUE(output == "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n"
+                        "Via: 1.1 simple-http-server\r\n"
+                        "Connection: Keep-Alive\r\n\r\nhello");
+  EXPECT_TRUE(rewrite_forwarded_header(
+                  "GET / HTTP/1.0\r\nTE: trailers\r\nUpgrade: x\r\n"
+                  "Transfer-Encoding: chunked\r\n\r\n",
+                  "X-Forwarded-For: 1.2.3.4\r\n") ==
+              "GET / HTTP/1.0\r\nTransfer-Encoding: chunked\r\n"
+              "Via: 1.0 simple-http-server\r\n"
+              "X-Forwarded-For: 1.2.3.4\r\n\r\n");
+}
+
+// Sends a request to a local server and returns the first chunk of the reply
+std::string send_request(int fd, const std::string& request) {
+  char buffer[4096];
+  send(fd, request.c_str(), request.length(), MSG_NOSIGNAL);
+  ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+  return n > 0 ? std::string(buffer, n) : std::string();
+}
+
+int connect_to_local_port(std::uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  connect(fd, (sockaddr*)&address, sizeof(address));
+  return fd;
+}
+
+void test_large_response() {
+  HttpServer server("127.0.0.1", 0);
+  server.RegisterHttpRequestHandler(
+      "/large", HttpMethod::GET, [](const HttpRequest& request) {
+        HttpResponse response;
+        response.SetContent(std::string(100000, 'x') + request.header("X-Id"));
+        return response;
+      });
+  server.Start();
+
+  // both responses arrive in full on the same keep-alive connection
+  int fd = connect_to_local_port(server.port());
+  bool complete = true;
+  for (int i = 0; i < 2; i++) {
+    std::string request =
+        "GET /large HTTP/1.1\r\nX-Id: " + std::to_string(i) + "\r\n\r\n";
+    send(fd, request.c_str(), request.length(), MSG_NOSIGNAL);
+    std::string response, body;
+    char buffer[65536];
+    ssize_t n;
+    size_t end_of_header = std::string::npos;
+    while ((end_of_header == std::string::npos ||
+            response.length() < end_of_header + 4 + 100001) &&
+           (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+      response.append(buffer, n);
+      end_of_header = response.find("\r\n\r\n");
+    }
+    if (end_of_header != std::string::npos) {
+      body = response.substr(end_of_header + 4);
+    }
+    complete = complete &&
+               response.find("Content-Length: 100001") != std::string::npos &&
+               body == std::string(100000, 'x') + std::to_string(i);
+  }
+  EXPECT_TRUE(complete);
+  close(fd);
+  server.Stop();
+}
+
+void test_graceful_drain() {
+  HttpServer server("127.0.0.1", 0);
+  std::atomic<bool> handling(false);
+  server.RegisterHttpRequestHandler(
+      "/slow", HttpMethod::GET, [&handling](const HttpRequest&) {
+        handling = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        HttpResponse response;
+        response.SetContent("slow");
+        return response;
+      });
+  server.RegisterHttpRequestHandler(
+      "/fast", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent("fast");
+        return response;
+      });
+  server.Start();
+
+  int idle_fd = connect_to_local_port(server.port());
+  EXPECT_TRUE(send_request(idle_fd, "GET /fast HTTP/1.1\r\n\r\n")
+                  .find("Connection: close") == std::string::npos);
+  int silent_fd = connect_to_local_port(server.port());
+  int busy_fd = connect_to_local_port(server.port());
+  std::string request = "GET /slow HTTP/1.1\r\n\r\n";
+  send(busy_fd, request.data(), request.length(), MSG_NOSIGNAL);
+  while (!handling) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread stopper(
+      [&server] { server.Stop(std::chrono::milliseconds(500)); });
+
+  // the keep-alive request in flight is answered and ends the connection
+  char buffer[4096];
+  std::string response;
+  ssize_t n;
+  while ((n = recv(busy_fd, buffer, sizeof(buffer), 0)) > 0) {
+    response.append(buffer, n);
+  }
+  EXPECT_TRUE(response.find("Connection: close") != std::string::npos);
+  EXPECT_TRUE(response.find("\r\n\r\nslow") != std::string::npos);
+
+  // idle connections are closed without an answer, within the drain timeout
+  EXPECT_TRUE(recv(idle_fd, buffer, sizeof(buffer), 0) == 0);
+  EXPECT_TRUE(recv(silent_fd, buffer, sizeof(buffer), 0) <= 0);
+  stopper.join();
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start <
+              std::chrono::milliseconds(1500));
+  close(idle_fd);
+  close(silent_fd);
+  close(busy_fd);
+}
+
+void test_listener_handoff() {
+  std::string socket_path = "/tmp/simple_http_server_handoff_test.sock";
+  HttpServer old_server("127.0.0.1", 0);
+  std::atomic<bool> handling(false);
+  old_server.RegisterHttpRequestHandler(
+      "/slow", HttpMethod::GET, [&handling](const HttpRequest&) {
+        handling = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        HttpResponse response;
+        response.SetContent("slow");
+        return response;
+      });
+  old_server.Start();
+  std::uint16_t port = old_server.port();
+
+  int busy_fd = connect_to_local_port(port);
+  std::string request = "GET /slow HTTP/1.1\r\n\r\n";
+  send(busy_fd, request.data(), request.length(), MSG_NOSIGNAL);
+  while (!handling) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  std::thread old_process([&old_server, &socket_path] {
+    old_server.HandOffListeners(socket_path, std::chrono::milliseconds(2000));
+  });
+
+  // the replacement takes over the listening socket, and accepts while the
+  // old server is still draining
+  std::vector<int> fds;
+  for (int i = 0; i < 100 && fds.empty(); i++) {
+    try {
+      fds = HttpServer::TakeOverListeners(socket_path);
+    } catch (const std::runtime_error& e) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  EXPECT_TRUE(fds.size() == 1);
+  HttpServer new_server(fds);
+  new_server.RegisterHttpRequestHandler(
+      "/who", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent("new");
+        return response;
+      });
+  new_server.Start();
+  EXPECT_TRUE(new_server.port() == port);
+  while (!old_server.draining()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  int fd = connect_to_local_port(port);
+  EXPECT_TRUE(send_request(fd, "GET /who HTTP/1.1\r\n\r\n")
+                  .find("\r\n\r\nnew") != std::string::npos);
+  close(fd);
+
+  char buffer[4096];
+  std::string response;
+  ssize_t n;
+  while ((n = recv(busy_fd, buffer, sizeof(buffer), 0)) > 0) {
+    response.append(buffer, n);
+  }
+  EXPECT_TRUE(response.find("Connection: close") != std::string::npos);
+  EXPECT_TRUE(response.find("\r\n\r\nslow") != std::string::npos);
+  close(busy_fd);
+  old_process.join();
+  new_server.Stop();
+
+  // a handoff nobody takes gives up, and leaves no socket file behind
+  int listening_fd = socket(AF_INET, SOCK_STREAM, 0);
+  bool timed_out = false;
+  try {
+    offer_file_descriptors(socket_path, {listening_fd},
+                           std::chrono::milliseconds(50));
+  } catch (const std::runtime_error& e) {
+    timed_out = true;
+  }
+  EXPECT_TRUE(timed_out);
+  EXPECT_TRUE(access(socket_path.c_str(), F_OK) != 0);
+  close(listening_fd);
+}
+
+void test_reverse_proxy() {
+  HttpServer backend("127.0.0.1", 0), proxy("127.0.0.1", 0);
+  backend.RegisterHttpRequestHandler(
+      "/api/hello", HttpMethod::GET, [](const HttpRequest& request) {
+        HttpResponse response;
+        response.SetContent("hello " + request.header("X-Name"));
+        return response;
+      });
+  backend.RegisterHttpRequestHandler(
+      "/api/headers", HttpMethod::GET, [](const HttpRequest& request) {
+        std::string seen;
+        for (const char* name : {"Connection", "X-Drop", "Keep-Alive", "TE",
+                                 "Proxy-Authorization"}) {
+          if (!request.header(name).empty()) seen += name;
+        }
+        HttpResponse response;
+        response.SetHeader("Connection", "X-Secret");
+        response.SetHeader("X-Secret", "1");
+        response.SetContent(seen + "|" + request.header("X-Forwarded-For") +
+                            "|" + request.header("Via"));
+        return response;
+      });
+  backend.Start();
+  // an upstream that reports the size of the request it got, whatever it is
+  int raw_backend = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  socklen_t address_len = sizeof(address);
+  bind(raw_backend, (sockaddr*)&address, sizeof(address));
+  listen(raw_backend, 1);
+  getsockname(raw_backend, (sockaddr*)&address, &address_len);
+  std::thread raw_backend_thread([raw_backend] {
+    int fd;
+    std::string request;
+    char buffer[4096];
+    ssize_t n;
+    // health checks connect without sending anything
+    while (request.empty()) {
+      fd = accept(raw_backend, nullptr, nullptr);
+      if (fd < 0) return;  // the test is over
+      while (request.find("\r\n\r\n") == std::string::npos &&
+             (n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        request.append(buffer, n);
+      }
+      if (request.empty()) close(fd);
+    }
+    std::string size = std::to_string(request.length());
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " +
+                           std::to_string(size.length()) + "\r\n\r\n" + size;
+    send(fd, response.data(), response.length(), MSG_NOSIGNAL);
+    close(fd);
+  });
+  proxy.RegisterProxyRoute("/api", {{"127.0.0.1", backend.port()}});
+  proxy.RegisterProxyRoute("/raw", {{"127.0.0.1", ntohs(address.sin_port)}});
+  // a single worker, with a single pool of upstream connections
+  proxy.SetWorkerCount(1);
+  proxy.Start();
+
+  // both requests go over the same client and pooled upstream connections
+  int fd = connect_to_local_port(proxy.port());
+  std::string response =
+      send_request(fd, "GET /api/hello HTTP/1.1\r\nX-Name: a\r\n\r\n");
+  EXPECT_TRUE(response.find("200 OK") != std::string::npos);
+  EXPECT_TRUE(response.find("\r\n\r\nhello a") != std::string::npos);
+  response = send_request(fd, "GET /api/missing HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(response.find("404 Not Found") != std::string::npos);
+  close(fd);
+
+  // hop-by-hop fields go no further than the proxy, in either direction,
+  // and the client closing its connection leaves the pooled one open
+  for (int i = 0; i < 2; i++) {
+    fd = connect_to_local_port(proxy.port());
+    response = send_request(
+        fd, "GET /api/headers HTTP/1.1\r\nConnection: close, X-Drop\r\n"
+            "X-Drop: 1\r\nKeep-Alive: 300\r\nTE: trailers\r\n"
+            "Proxy-Authorization: Basic eA==\r\n\r\n");
+    EXPECT_TRUE(response.find("\r\n\r\n|127.0.0.1|1.1 simple-http-server") !=
+                std::string::npos);
+    EXPECT_TRUE(response.find("X-Secret") == std::string::npos);
+    EXPECT_TRUE(response.find("Via: 1.1 simple-http-server") !=
+                std::string::npos);
+    EXPECT_TRUE(response.find("Connection: close") != std::string::npos);
+    close(fd);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_TRUE(backend.metrics().active_connections == 1);
+
+  // the fields the proxy adds may take a request that fills the connection
+  // buffer past it
+  std::string request = "GET /raw HTTP/1.1\r\nX-Pad: ";
+  request += std::string(kMaxBufferSize - request.length() - 4, 'p') +
+             "\r\n\r\n";
+  fd = connect_to_local_port(proxy.port());
+  response = send_request(fd, request);
+  EXPECT_TRUE(response.find("200 OK") != std::string::npos);
+  size_t end_of_header = response.find("\r\n\r\n");
+  EXPECT_TRUE(end_of_header != std::string::npos &&
+              strtoul(response.c_str() + end_of_header + 4, nullptr, 10) >
+                  kMaxBufferSize);
+  close(fd);
+  shutdown(raw_backend, SHUT_RDWR);
+  raw_backend_thread.join();
+  close(raw_backend);
+
+  proxy.Stop();
+  backend.Stop();
+}
+
+void test_multiple_listeners() {
+  std::string socket_path = "/tmp/simple_http_server_test.sock";
+  HttpServer server;
+  ListenerOptions options;
+  options.tcp_nodelay = true;
+  options.defer_accept_seconds = 5;
+  options.fastopen_queue_length = 16;
+  options.receive_buffer_size = 65536;
+  options.send_buffer_size = 65536;
+  server.AddTcpListener("::1", 0, options);
+  server.AddUnixListener(socket_path);
+  server.RegisterHttpRequestHandler(
+      "/", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent("hello");
+        return response;
+      });
+  server.Start();
+  EXPECT_TRUE(server.listeners()[0].type() == ListenerType::kTcp6);
+  EXPECT_TRUE(server.port() != 0);
+
+  // the options are set on the listening socket. The kernel rounds the
+  // defer-accept delay to retransmissions and doubles the buffer sizes.
+  int listening_fd = server.listeners()[0].fd();
+  int value = 0;
+  socklen_t value_len = sizeof(value);
+  EXPECT_TRUE(getsockopt(listening_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &value,
+                         &value_len) == 0 &&
+              value >= 5);
+  value_len = sizeof(value);
+  EXPECT_TRUE(getsockopt(listening_fd, IPPROTO_TCP, TCP_FASTOPEN, &value,
+                         &value_len) == 0 &&
+              value == 16);
+  value_len = sizeof(value);
+  EXPECT_TRUE(getsockopt(listening_fd, SOL_SOCKET, SO_RCVBUF, &value,
+                         &value_len) == 0 &&
+              value >= 65536);
+  value_len = sizeof(value);
+  EXPECT_TRUE(getsockopt(listening_fd, SOL_SOCKET, SO_SNDBUF, &value,
+                         &value_len) == 0 &&
+              value >= 65536);
+
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  sockaddr_in6 address6 = {};
+  address6.sin6_family = AF_INET6;
+  address6.sin6_port = htons(server.port());
+  inet_pton(AF_INET6, "::1", &address6.sin6_addr);
+  EXPECT_TRUE(connect(fd, (sockaddr*)&address6, sizeof(address6)) == 0);
+  EXPECT_TRUE(send_request(fd, "GET / HTTP/1.1\r\n\r\n").find("hello") !=
+              std::string::npos);
+  close(fd);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address_un = {};
+  address_un.sun_family = AF_UNIX;
+  strncpy(address_un.sun_path, socket_path.c_str(),
+          sizeof(address_un.sun_path) - 1);
+  EXPECT_TRUE(connect(fd, (sockaddr*)&address_un, sizeof(address_un)) == 0);
+  EXPECT_TRUE(send_request(fd, "GET / HTTP/1.1\r\n\r\n").find("hello") !=
+              std::string::npos);
+  close(fd);
+
+  server.Stop();
+  EXPECT_TRUE(access(socket_path.c_str(), F_OK) != 0);
+}
+
+void test_prefork_server() {
+  std::string bundle_path = "/tmp/simple_http_server_prefork_test.bundle";
+  std::vector<BundleFile> files(1);
+  files[0].paths = {"/large"};
+  files[0].content = std::string(16 << 20, 'x');
+  pack_content_bundle(files, bundle_path);
+
+  PreforkOptions options;
+  options.processes = 2;
+  options.restart_delay = std::chrono::milliseconds(10);
+  PreforkServer server("127.0.0.1", 0, options);
+  server.server().MountContentBundle("/static/", bundle_path);
+  server.RegisterHttpRequestHandler(
+      "/pid", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent(std::to_string(getpid()));
+        return response;
+      });
+  server.RegisterHttpRequestHandler(
+      "/crash", HttpMethod::GET, [](const HttpRequest&) {
+        raise(SIGKILL);
+        return HttpResponse();
+      });
+  // the processes outlive the thread that started them
+  std::thread([&server]() { server.Start(); }).join();
+  std::vector<pid_t> pids = server.worker_pids();
+  const std::vector<pid_t> started_pids = pids;
+  EXPECT_TRUE(pids.size() == 2 && pids[0] > 0 && pids[1] > 0);
+
+  int fd = connect_to_local_port(server.port());
+  std::string response = send_request(fd, "GET /pid HTTP/1.1\r\n\r\n");
+  EXPECT_TRUE(response.find("200 OK") != std::string::npos);
+  pid_t pid = std::stoi(response.substr(response.find("\r\n\r\n") + 4));
+  EXPECT_TRUE(std::find(pids.begin(), pids.end(), pid) != pids.end());
+  EXPECT_TRUE(server.metrics().requests == 1);
+  EXPECT_TRUE(server.metrics().active_connections == 1);
+
+  // the crash only takes down the connection of one process, which is
+  // replaced
+  EXPECT_TRUE(send_request(fd, "GET /crash HTTP/1.1\r\n\r\n").empty());
+  close(fd);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  do {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    pids = server.worker_pids();
+  } while (std::chrono::steady_clock::now() < deadline &&
+           (server.metrics().restarts == 0 ||
+            std::count(pids.begin(), pids.end(), 0) > 0));
+  EXPECT_TRUE(server.metrics().restarts == 1);
+  EXPECT_TRUE(std::find(pids.begin(), pids.end(), pid) == pids.end());
+  EXPECT_TRUE(server.metrics().active_connections == 0);
+
+  for (int i = 0; i < 10; i++) {
+    fd = connect_to_local_port(server.port());
+    EXPECT_TRUE(send_request(fd, "GET /pid HTTP/1.1\r\n\r\n")
+                    .find("200 OK") != std::string::npos);
+    close(fd);
+  }
+  EXPECT_TRUE(server.metrics().requests == 12);
+
+  // The replacement process is stuck writing a response nobody reads, and
+  // gives up on it after the drain timeout passed to Stop(), instead of
+  // being killed a second later
+  pid_t replacement = 0;
+  for (pid_t worker : server.worker_pids()) {
+    if (std::find(started_pids.begin(), started_pids.end(), worker) ==
+        started_pids.end()) {
+      replacement = worker;
+    }
+  }
+  int stuck = -1;
+  for (int i = 0; i < 50 && stuck < 0; i++) {
+    fd = connect_to_local_port(server.port());
+    response = send_request(fd, "GET /pid HTTP/1.1\r\n\r\n");
+    if (std::stoi(response.substr(response.find("\r\n\r\n") + 4)) ==
+        replacement) {
+      stuck = fd;
+    } else {
+      close(fd);
+    }
+  }
+  EXPECT_TRUE(stuck >= 0);
+  send(stuck, "GET /static/large HTTP/1.1\r\n\r\n", 31, MSG_NOSIGNAL);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  auto start = std::chrono::steady_clock::now();
+  server.Stop(std::chrono::milliseconds(100));
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start <
+              std::chrono::milliseconds(800));
+  EXPECT_TRUE(!server.running());
+  close(stuck);
+  unlink(bundle_path.c_str());
+}
+
+void test_content_bundle() {
+  std::string bundle_path = "/tmp/simple_http_server_test.bundle";
+  std::vector<BundleFile> files(2);
+  files[0].paths = {"/index.html", "/"};
+  files[0].content_type = "text/html";
+  files[0].content = "<h1>hello</h1>";
+  files[0].gzip_content = "not really gzip";
+  files[1].paths = {"/app.js"};
+  files[1].content_type = "text/javascript";
+  files[1].content = std::string(100000, 'x');
+  for (int i = 0; i < 1000; i++) {
+    files.push_back(BundleFile());
+    files.back().paths = {"/file" + std::to_string(i)};
+    files.back().content = std::to_string(i);
+  }
+  pack_content_bundle(files, bundle_path);
+
+  {
+    ContentBundle bundle(bundle_path);
+    EXPECT_TRUE(bundle.size() == 1003);
+    bool all_found = true;
+    for (int i = 0; i < 1000; i++) {
+      const BundleEntry* entry = bundle.Find("/file" + std::to_string(i));
+      all_found = all_found && entry != nullptr &&
+                  std::string(bundle.data(entry->identity.body),
+                              entry->identity.body.length) ==
+                      std::to_string(i);
+    }
+    EXPECT_TRUE(all_found);
+    EXPECT_TRUE(bundle.Find("/file1000") == nullptr);
+    EXPECT_TRUE(bundle.Find("") == nullptr);
+  }
+  EXPECT_TRUE(accepts_gzip("deflate, GZip;q=0.5"));
+  EXPECT_TRUE(!accepts_gzip("gzip;q=0, br"));
+  EXPECT_TRUE(!accepts_gzip("identity"));
+
+  HttpServer server("127.0.0.1", 0);
+  server.MountContentBundle("/static/", bundle_path);
+  server.Start();
+  int fd = connect_to_local_port(server.port());
+  std::string response = send_request(
+      fd, "GET /static/ HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n");
+  EXPECT_TRUE(response.find("200 OK") != std::string::npos);
+  EXPECT_TRUE(response.find("Content-Encoding: gzip") != std::string::npos);
+  EXPECT_TRUE(response.find("\r\n\r\nnot really gzip") != std::string::npos);
+
+  response = send_request(fd, "GET /static/index.html HTTP/1.1\r\n\r\n");
+  size_t etag = response.find("ETag: ");
+  EXPECT_TRUE(response.find("\r\n\r\n<h1>hello</h1>") != std::string::npos);
+  EXPECT_TRUE(etag != std::string::npos);
+  std::string etag_value =
+      response.substr(etag + 6, response.find("\r\n", etag) - etag - 6);
+  response = send_request(fd, "GET /static/index.html HTTP/1.1\r\n"
+                              "If-None-Match: " + etag_value + "\r\n\r\n");
+  EXPECT_TRUE(response.find("304 Not Modified") != std::string::npos);
+  EXPECT_TRUE(response.find("\r\n\r\n") == response.length() - 4);
+
+  // a body much larger than the connection buffer
+  send(fd, "GET /static/app.js HTTP/1.0\r\n\r\n", 32, MSG_NOSIGNAL);
+  std::string body;
+  char buffer[65536];
+  ssize_t n;
+  while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) body.append(buffer, n);
+  EXPECT_TRUE(body.find("Connection: close") != std::string::npos);
+  EXPECT_TRUE(body.length() > 100000 &&
+              body.compare(body.length() - 100000, 100000,
+                           std::string(100000, 'x')) == 0);
+  close(fd);
+
+  fd = connect_to_local_port(server.port());
+  EXPECT_TRUE(send_request(fd, "GET /static/missing HTTP/1.1\r\n\r\n")
+                  .find("404 Not Found") != std::string::npos);
+  close(fd);
+  server.Stop();
+  unlink(bundle_path.c_str());
+}
+
+void test_worker_distributor() {
+  WorkerLoad loads[3];
+  loads[0].connections = 5;
+  loads[2].connections = 3;
+  loads[1].ready_events = 1;
+  WorkerDistributor distributor;
+  EXPECT_TRUE(distributor.Pick(loads, 3) == 0);
+  EXPECT_TRUE(distributor.Pick(loads, 3) == 1);
+  EXPECT_TRUE(distributor.Pick(loads, 3) == 2);
+
+  distributor.SetPolicy(DistributionPolicy::kLeastConnections);
+  bool least = true;
+  for (int i = 0; i < 10; i++) least = least && distributor.Pick(loads, 3) == 1;
+  EXPECT_TRUE(least);
+
+  // the most loaded worker always loses against the other one
+  distributor.SetPolicy(DistributionPolicy::kPowerOfTwoChoices);
+  bool never_most_loaded = true;
+  for (int i = 0; i < 100; i++) {
+    never_most_loaded = never_most_loaded && distributor.Pick(loads, 3) != 0;
+  }
+  EXPECT_TRUE(never_most_loaded);
+  EXPECT_TRUE(least_connected_worker(loads, 3, 1) == 2);
+}
+
+void test_connection_migration() {
+  HttpServer server("127.0.0.1", 0);
+  DistributionOptions options;
+  options.migrate_idle_connections = true;
+  options.migration_threshold = 4;
+  server.SetDistributionOptions(options);
+  server.RegisterHttpRequestHandler(
+      "/", HttpMethod::GET,
+      [](const HttpRequest&) { return HttpResponse(); });
+  server.Start();
+
+  // Connections go to the workers in turn. Keeping every fifth one leaves
+  // all of them on the first worker.
+  std::vector<int> fds, kept;
+  for (int i = 0; i < 50; i++) {
+    fds.push_back(connect_to_local_port(server.port()));
+  }
+  auto total = [&]() {
+    int sum = 0;
+    for (int i = 0; i < 5; i++) sum += server.worker_connections(i);
+    return sum;
+  };
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (total() < 50 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (int i = 0; i < 50; i++) {
+    if (i % 5 == 0) {
+      kept.push_back(fds[i]);
+    } else {
+      close(fds[i]);
+    }
+  }
+  deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  int busiest;
+  do {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    busiest = 0;
+    for (int i = 0; i < 5; i++) {
+      busiest = std::max(busiest, server.worker_connections(i));
+    }
+  } while ((total() != 10 || busiest > 5) &&
+           std::chrono::steady_clock::now() < deadline);
+  EXPECT_TRUE(total() == 10);
+  EXPECT_TRUE(busiest <= 5);
+
+  // the connections keep working on their new workers
+  bool served = true;
+  for (int fd : kept) {
+    served = served && send_request(fd, "GET / HTTP/1.1\r\n\r\n")
+                               .find("200 OK") != std::string::npos;
+    close(fd);
+  }
+  EXPECT_TRUE(served);
+  server.Stop();
+}
+
+void test_batched_pipeline() {
+  std::string bundle_path = "/tmp/simple_http_server_batch_test.bundle";
+  std::vector<BundleFile> files(1);
+  files[0].paths = {"/large"};
+  files[0].content = std::string(1 << 20, 'x');
+  pack_content_bundle(files, bundle_path);
+
+  HttpServer server("127.0.0.1", 0);
+  server.SetWorkerCount(1);
+  server.EnableBatchedPipeline();
+  server.MountContentBundle("/static/", bundle_path);
+  server.RegisterHttpRequestHandler(
+      "/echo", HttpMethod::GET, [](const HttpRequest& request) {
+        HttpResponse response;
+        response.SetContent(request.header("X-Id"));
+        return response;
+      });
+  server.Start();
+
+  // requests sent on all connections before reading any response are
+  // handled in the same batches, and the connections stay usable
+  std::vector<int> fds;
+  for (int i = 0; i < 20; i++) {
+    fds.push_back(connect_to_local_port(server.port()));
+  }
+  bool served = true;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 20; i++) {
+      std::string request = "GET /echo HTTP/1.1\r\nX-Id: " +
+                            std::to_string(round * 20 + i) + "\r\n\r\n";
+      send(fds[i], request.c_str(), request.length(), MSG_NOSIGNAL);
+    }
+    for (int i = 0; i < 20; i++) {
+      char buffer[4096];
+      ssize_t n = recv(fds[i], buffer, sizeof(buffer), 0);
+      std::string response = n > 0 ? std::string(buffer, n) : std::string();
+      std::string id = std::to_string(round * 20 + i);
+      served = served && response.find("200 OK") != std::string::npos &&
+               response.compare(response.length() - id.length(),
+                                id.length(), id) == 0;
+    }
+  }
+  EXPECT_TRUE(served);
+
+  // a response that does not fit in the socket buffer is finished later
+  std::string response = "GET /static/large HTTP/1.1\r\n\r\n";
+  send(fds[0], response.c_str(), response.length(), MSG_NOSIGNAL);
+  response.clear();
+  char buffer[65536];
+  ssize_t n;
+  while (response.length() < (1 << 20) &&
+         (n = recv(fds[0], buffer, sizeof(buffer), 0)) > 0) {
+    response.append(buffer, n);
+  }
+  size_t end_of_header = response.find("\r\n\r\n");
+  EXPECT_TRUE(end_of_header != std::string::npos);
+  while (response.length() < end_of_header + 4 + (1 << 20) &&
+         (n = recv(fds[0], buffer, sizeof(buffer), 0)) > 0) {
+    response.append(buffer, n);
+  }
+  EXPECT_TRUE(response.length() == end_of_header + 4 + (1 << 20));
+  EXPECT_TRUE(send_request(fds[0], "GET /echo HTTP/1.1\r\nX-Id: 1\r\n\r\n")
+                  .find("200 OK") != std::string::npos);
+
+  for (int fd : fds) close(fd);
+  server.Stop();
+  unlink(bundle_path.c_str());
+}
+
+int thread_count() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 8, "Threads:") == 0) return std::stoi(line.substr(8));
+  }
+  return -1;
+}
+
+void test_external_event_loop() {
+  HttpServer server("127.0.0.1", 0);
+  HttpServerOptions options;
+  options.workers = 2;
+  options.external_event_loop = true;
+  server.Configure(options);
+  server.RegisterHttpRequestHandler(
+      "/", HttpMethod::GET,
+      [](const HttpRequest&) { return HttpResponse(); });
+  int threads = thread_count();
+  server.Start();
+  EXPECT_TRUE(thread_count() == threads);
+
+  // nothing happens until the workers are polled
+  int fd = connect_to_local_port(server.port());
+  send(fd, "GET / HTTP/1.1\r\n\r\n", 18, MSG_NOSIGNAL);
+  for (int i = 0; i < 10; i++) {
+    server.PollOnce(0, std::chrono::milliseconds(1));
+    server.PollOnce(1, std::chrono::milliseconds(1));
+  }
+  char buffer[4096];
+  ssize_t n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+  EXPECT_TRUE(n > 0 &&
+              std::string(buffer, n).find("200 OK") != std::string::npos);
+
+  // threads of the host run one worker each
+  std::atomic<bool> polling(true);
+  std::vector<std::thread> hosts;
+  for (int i = 0; i < 2; i++) {
+    hosts.emplace_back([&server, &polling, i]() {
+      while (polling) server.RunFor(std::chrono::milliseconds(10), i);
+    });
+  }
+  bool served = send_request(fd, "GET / HTTP/1.1\r\n\r\n")
+                    .find("200 OK") != std::string::npos;
+  for (int i = 0; i < 10; i++) {
+    int client = connect_to_local_port(server.port());
+    served = served && send_request(client, "GET / HTTP/1.1\r\n\r\n")
+                               .find("200 OK") != std::string::npos;
+    close(client);
+  }
+  EXPECT_TRUE(served);
+  polling = false;
+  for (auto& host : hosts) host.join();
+
+  // Stop() drains the open connection without the host polling
+  server.Stop();
+  EXPECT_TRUE(recv(fd, buffer, sizeof(buffer), 0) == 0);
+  close(fd);
+  bool rejected = false;
+  try {
+    server.PollOnce();
+  } catch (const std::logic_error& e) {
+    rejected = true;
+  }
+  EXPECT_TRUE(rejected);
+
+  // proxy routes and the access log start no threads either: the polled
+  // workers check the upstreams and write the log
+  std::string log_path = "/tmp/simple_http_server_external_test.log";
+  unlink(log_path.c_str());
+  HttpServer backend("127.0.0.1", 0);
+  backend.RegisterHttpRequestHandler(
+      "/api/hello", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent("hello");
+        return response;
+      });
+  backend.Start();
+  std::uint16_t backend_port = backend.port();
+  HttpServer proxy("127.0.0.1", 0);
+  options.workers = 1;
+  proxy.Configure(options);
+  proxy.RegisterProxyRoute("/api", {{"127.0.0.1", backend_port}});
+  AccessLogOptions log_options;
+  log_options.flush_interval = std::chrono::milliseconds(10);
+  proxy.EnableAccessLog(log_path, log_options);
+  threads = thread_count();
+  proxy.Start();
+  EXPECT_TRUE(thread_count() == threads);
+
+  polling = true;
+  std::thread host([&proxy, &polling]() {
+    while (polling) proxy.RunFor(std::chrono::milliseconds(10));
+  });
+  auto get_hello = [&proxy]() {
+    int client = connect_to_local_port(proxy.port());
+    std::string response =
+        send_request(client, "GET /api/hello HTTP/1.1\r\n\r\n");
+    close(client);
+    return response;
+  };
+  EXPECT_TRUE(get_hello().find("\r\n\r\nhello") != std::string::npos);
+
+  // once the upstream is back, only a health check can mark it healthy again
+  backend.Stop();
+  EXPECT_TRUE(get_hello().find("502 Bad Gateway") != std::string::npos);
+  HttpServer restarted_backend("127.0.0.1", backend_port);
+  restarted_backend.RegisterHttpRequestHandler(
+      "/api/hello", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent("hello");
+        return response;
+      });
+  restarted_backend.Start();
+  bool recovered = false;
+  for (int i = 0; i < 40 && !recovered; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    recovered =
+        get_hello().find("\r\n\r\nhello") != std::string::npos;
+  }
+  EXPECT_TRUE(recovered);
+
+  // the records are written while the workers are polled, before Stop()
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  std::ifstream log(log_path);
+  std::string line;
+  int lines = 0;
+  while (std::getline(log, line)) lines++;
+  EXPECT_TRUE(lines >= 3);
+  polling = false;
+  host.join();
+  proxy.Stop();
+  restarted_backend.Stop();
+  unlink(log_path.c_str());
+}
+
+void test_spsc_ring() {
+  SpscRing<int> ring(3);
+  int items[4];
+  EXPECT_TRUE(ring.capacity() == 4);
+  for (int i = 0; i < 4; i++) EXPECT_TRUE(ring.TryPush(i));
+  EXPECT_TRUE(!ring.TryPush(4));
+  EXPECT_TRUE(ring.Pop(items, 2) == 2 && items[0] == 0 && items[1] == 1);
+  EXPECT_TRUE(ring.TryPush(4) && ring.TryPush(5));
+  EXPECT_TRUE(ring.Pop(items, 4) == 4 && items[0] == 2 && items[3] == 5);
+  EXPECT_TRUE(ring.Pop(items, 4) == 0);
+}
+
+void test_access_log() {
+  std::string log_path = "/tmp/simple_http_server_test.log";
+  unlink(log_path.c_str());
+  HttpServer server("127.0.0.1", 0);
+  server.EnableAccessLog(log_path);
+  server.RegisterHttpRequestHandler(
+      "/hello", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent("hello");
+        return response;
+      });
+  server.Start();
+  int fd = connect_to_local_port(server.port());
+  send_request(fd, "GET /hello HTTP/1.1\r\n\r\n");
+  send_request(fd, "GET /missing HTTP/1.1\r\n\r\n");
+  close(fd);
+  server.Stop();  // flushes the log
+
+  std::ifstream log(log_path);
+  std::string first, second;
+  EXPECT_TRUE(std::getline(log, first) && std::getline(log, second));
+  EXPECT_TRUE(first.find("\"path\":\"/hello\"") != std::string::npos);
+  EXPECT_TRUE(first.find("\"status\":200") != std::string::npos);
+  EXPECT_TRUE(second.find("\"status\":404") != std::string::npos);
+  EXPECT_TRUE(server.access_log()->dropped() == 0);
+  unlink(log_path.c_str());
+}
+
+// Writes a self-signed certificate for localhost and its key as PEM files
+void write_self_signed_certificate(const std::string& certificate_file,
+                                   const std::string& key_file) {
+  EVP_PKEY* key = EVP_EC_gen("P-256");
+  X509* certificate = X509_new();
+  X509_set_version(certificate, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+  X509_set_pubkey(certificate, key);
+  X509_NAME* name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char*)"localhost", -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  X509_sign(certificate, key, EVP_sha256());
+
+  FILE* file = fopen(certificate_file.c_str(), "w");
+  PEM_write_X509(file, certificate);
+  fclose(file);
+  file = fopen(key_file.c_str(), "w");
+  PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+  fclose(file);
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+}
+
+// Sends a request over a new TLS connection, resuming `*session` if set,
+// and returns the response. `*session` is replaced by the new session.
+std::string send_tls_request(SSL_CTX* context, std::uint16_t port,
+                             const std::string& request, SSL_SESSION** session,
+                             bool* resumed) {
+  char buffer[4096];
+  std::string response;
+  int fd = connect_to_local_port(port);
+  SSL* ssl = SSL_new(context);
+  SSL_set_fd(ssl, fd);
+  if (*session != nullptr) SSL_set_session(ssl, *session);
+  if (SSL_connect(ssl) == 1) {
+    SSL_write(ssl, request.c_str(), request.length());
+    int n;
+    while ((n = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+      response.append(buffer, n);
+    }
+    *resumed = SSL_session_reused(ssl) == 1;
+    SSL_shutdown(ssl);  // a session that is not shut down cannot be resumed
+    SSL_SESSION_free(*session);
+    *session = SSL_get1_session(ssl);
+  }
+  SSL_free(ssl);
+  close(fd);
+  return response;
+}
+
+void test_tls() {
+  TlsOptions tls;
+  tls.certificate_file = "/tmp/simple_http_server_test.crt";
+  tls.private_key_file = "/tmp/simple_http_server_test.key";
+  write_self_signed_certificate(tls.certificate_file, tls.private_key_file);
+  std::string bundle_path = "/tmp/simple_http_server_tls_test.bundle";
+  std::vector<BundleFile> files(1);
+  files[0].paths = {"/large"};
+  files[0].content = std::string(100000, 'k');
+  pack_content_bundle(files, bundle_path);
+
+  HttpServer server;
+  server.AddTlsListener("127.0.0.1", 0, tls);
+  server.MountContentBundle("/static/", bundle_path);
+  server.RegisterHttpRequestHandler(
+      "/", HttpMethod::GET, [](const HttpRequest&) {
+        HttpResponse response;
+        response.SetContent("secret");
+        return response;
+      });
+  server.Start();
+
+  SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+  SSL_SESSION* session = nullptr;
+  bool resumed = true;
+  std::string request = "GET / HTTP/1.1\r\nConnection: close\r\n\r\n";
+  std::string response =
+      send_tls_request(context, server.port(), request, &session, &resumed);
+  EXPECT_TRUE(response.find("200 OK") != std::string::npos);
+  EXPECT_TRUE(response.find("\r\n\r\nsecret") != std::string::npos);
+  EXPECT_TRUE(!resumed);
+  response =
+      send_tls_request(context, server.port(), request, &session, &resumed);
+  EXPECT_TRUE(response.find("secret") != std::string::npos);
+  EXPECT_TRUE(resumed);
+
+  // a file from a content bundle goes out through kTLS when the kernel
+  // has it, and through OpenSSL otherwise
+  response = send_tls_request(context, server.port(),
+                              "GET /static/large HTTP/1.1\r\n"
+                              "Connection: close\r\n\r\n",
+                              &session, &resumed);
+  EXPECT_TRUE(response.find("\r\n\r\n" + files[0].content) !=
+              std::string::npos);
+  std::ifstream ulp("/proc/sys/net/ipv4/tcp_available_ulp");
+  std::string ulp_names((std::istreambuf_iterator<char>(ulp)),
+                        std::istreambuf_iterator<char>());
+  std::uint64_t kernel_tls_connections =
+      server.metrics().kernel_tls_connections.load();
+  EXPECT_TRUE(kernel_tls_connections <= 3);
+  if (ulp_names.find("tls") == std::string::npos) {
+    EXPECT_TRUE(kernel_tls_connections == 0);
+  }
+
+  // with kTLS turned off, OpenSSL always encrypts
+  TlsOptions user_space_tls = tls;
+  user_space_tls.kernel_tls = false;
+  HttpServer user_space_server;
+  user_space_server.AddTlsListener("127.0.0.1", 0, user_space_tls);
+  user_space_server.MountContentBundle("/static/", bundle_path);
+  user_space_server.Start();
+  SSL_SESSION* fresh_session = nullptr;
+  response = send_tls_request(context, user_space_server.port(),
+                              "GET /static/large HTTP/1.1\r\n"
+                              "Connection: close\r\n\r\n",
+                              &fresh_session, &resumed);
+  EXPECT_TRUE(response.find("\r\n\r\n" + files[0].content) !=
+              std::string::npos);
+  EXPECT_TRUE(user_space_server.metrics().kernel_tls_connections == 0);
+  user_space_server.Stop();
+  SSL_SESSION_free(fresh_session);
+  SSL_SESSION_free(session);
+  SSL_CTX_free(context);
+
+  // a plaintext request on the TLS port fails the handshake
+  int fd = connect_to_local_port(server.port());
+  EXPECT_TRUE(send_request(fd, "GET / HTTP/1.1\r\n\r\n").find("secret") ==
+              std::string::npos);
+  close(fd);
+
+  server.Stop();
+  unlink(bundle_path.c_str());
+  unlink(tls.certificate_file.c_str());
+  unlink(tls.private_key_file.c_str());
+}
+
+// Encodes a frame the way a client does, masked
+std::string mask_websocket_frame(std::uint8_t first_byte,
+                                 const std::string& payload) {
+  const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+  std::string frame(1, first_byte);
+  frame.push_back(0x80 | 126);
+  frame.push_back(payload.length() >> 8);
+  frame.push_back(payload.length() & 0xFF);
+  frame.append((const char*)mask, 4);
+  std::string masked = payload;
+  for (size_t i = 0; i < masked.length(); i++) masked[i] ^= mask[i % 4];
+  return frame + masked;
+}
+
+void test_websocket_frames() {
+  EXPECT_TRUE(websocket_accept_key("dGhlIHNhbXBsZSBub25jZQ==") ==
+              "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+  EXPECT_TRUE(encode_websocket_frame(WebSocketOpcode::kText, "hi") ==
+              std::string("\x81\x02hi"));
+  EXPECT_TRUE(encode_websocket_frame(WebSocketOpcode::kBinary,
+                                     std::string(70000, 'x'))
+                  .compare(0, 10, std::string("\x82\x7f\0\0\0\0\0\x01\x11\x70",
+                                              10)) == 0);
+
+  // unmasking a payload in pieces gives the same result as all at once
+  const unsigned char mask[4] = {1, 2, 3, 4};
+  std::string plain(1000, 0), whole, pieces;
+  for (size_t i = 0; i < plain.length(); i++) plain[i] = i * 7;
+  whole = pieces = plain;
+  unmask_websocket_payload(&whole[0], whole.length(), mask, 0);
+  for (size_t i = 0, n = 1; i < pieces.length(); i += n, n = n * 2 + 1) {
+    n = std::min(n, pieces.length() - i);
+    unmask_websocket_payload(&pieces[i], n, mask, i);
+  }
+  EXPECT_TRUE(whole == pieces && whole[5] == (plain[5] ^ mask[1]));
+
+  // a fragmented message with a ping in between, fed one byte at a time
+  std::string input = mask_websocket_frame(0x01, "hello ") +
+                      mask_websocket_frame(0x89, "ping") +
+                      mask_websocket_frame(0x80, std::string(300, 'w'));
+  std::vector<std::pair<WebSocketOpcode, std::string>> frames;
+  WebSocketParser parser;
+  for (char c : input) {
+    parser.Feed(&c, 1, [&](WebSocketOpcode opcode, const std::string& data) {
+      frames.emplace_back(opcode, data);
+    });
+  }
+  EXPECT_TRUE(frames.size() == 2);
+  EXPECT_TRUE(frames[0].first == WebSocketOpcode::kPing &&
+              frames[0].second == "ping");
+  EXPECT_TRUE(frames[1].first == WebSocketOpcode::kText &&
+              frames[1].second == "hello " + std::string(300, 'w'));
+
+  // client frames must be masked, and a continuation needs a message
+  bool thrown = false;
+  try {
+    std::string unmasked = encode_websocket_frame(WebSocketOpcode::kText, "x");
+    WebSocketParser().Feed(unmasked.data(), unmasked.length(),
+                           [](WebSocketOpcode, const std::string&) {});
+  } catch (const std::invalid_argument& e) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown);
+  thrown = false;
+  try {
+    std::string orphan = mask_websocket_frame(0x80, "x");
+    WebSocketParser().Feed(orphan.data(), orphan.length(),
+                           [](WebSocketOpcode, const std::string&) {});
+  } catch (const std::invalid_argument& e) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown);
+}
+
+void test_websocket_server() {
+  HttpServer server("127.0.0.1", 0);
+  std::atomic<int> open_sessions(0);
+  WebSocketHandler handler;
+  handler.on_open = [&](WebSocketSession&) { open_sessions++; };
+  handler.on_message = [](WebSocketSession& session, WebSocketOpcode,
+                          const std::string& message) {
+    session.SendText("echo " + message);
+  };
+  std::thread::id close_thread;
+  handler.on_close = [&](WebSocketSession&) {
+    open_sessions--;
+    close_thread = std::this_thread::get_id();
+  };
+  server.RegisterWebSocketHandler("/events", handler);
+  server.Start();
+
+  int fd = connect_to_local_port(server.port());
+  std::string response = send_request(
+      fd,
+      "GET /events HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n\r\n");
+  EXPECT_TRUE(response.find("101 Switching Protocols") != std::string::npos);
+  EXPECT_TRUE(response.find("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") !=
+              std::string::npos);
+
+  response = send_request(fd, mask_websocket_frame(0x81, "hi"));
+  EXPECT_TRUE(response == encode_websocket_frame(WebSocketOpcode::kText,
+                                                 "echo hi"));
+  response = send_request(fd, mask_websocket_frame(0x89, "are you there"));
+  EXPECT_TRUE(response == encode_websocket_frame(WebSocketOpcode::kPong,
+                                                 "are you there"));
+  EXPECT_TRUE(open_sessions == 1);
+  server.Broadcast("/events", WebSocketOpcode::kText, "news");
+  char buffer[64];
+  ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+  EXPECT_TRUE(n > 0 && std::string(buffer, n) ==
+                           encode_websocket_frame(WebSocketOpcode::kText,
+                                                  "news"));
+
+  // the server echoes the close frame and then closes the connection
+  response = send_request(fd, mask_websocket_frame(0x88, "\x03\xe8"));
+  EXPECT_TRUE(response ==
+              encode_websocket_frame(WebSocketOpcode::kClose, "\x03\xe8"));
+  EXPECT_TRUE(recv(fd, buffer, sizeof(buffer), 0) == 0);
+  EXPECT_TRUE(open_sessions == 0);
+  close(fd);
+
+  server.Stop();
+
+  // A client that stops reading never gets the close frame sent on Stop().
+  // Its session is closed once the drain timeout passes, still on its
+  // worker thread.
+  HttpServer stalled_server;
+  ListenerOptions options;
+  options.send_buffer_size = 4096;
+  stalled_server.AddTcpListener("127.0.0.1", 0, options);
+  stalled_server.RegisterWebSocketHandler("/events", handler);
+  stalled_server.Start();
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  int buffer_size = 4096;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(stalled_server.port());
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  connect(fd, (sockaddr*)&address, sizeof(address));
+  response = send_request(
+      fd,
+      "GET /events HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n\r\n");
+  EXPECT_TRUE(response.find("101 Switching Protocols") != std::string::npos);
+  while (open_sessions == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (int i = 0; i < 16; i++) {
+    stalled_server.Broadcast("/events", WebSocketOpcode::kBinary,
+                             std::string(1 << 16, 'b'));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  stalled_server.Stop(std::chrono::milliseconds(100));
+  EXPECT_TRUE(open_sessions == 0);
+  EXPECT_TRUE(close_thread != std::this_thread::get_id());
+  close(fd);
+}
+
+void test_external_loop_broadcast() {
+  HttpServer server("127.0.0.1", 0);
+  HttpServerOptions options;
+  options.workers = 1;
+  options.external_event_loop = true;
+  server.Configure(options);
+  server.RegisterWebSocketHandler("/events", WebSocketHandler());
+  server.Start();
+
+  int fd = connect_to_local_port(server.port());
+  std::string request =
+      "GET /events HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n\r\n";
+  send(fd, request.data(), request.length(), MSG_NOSIGNAL);
+  server.RunFor(std::chrono::milliseconds(50));
+  char buffer[4096];
+  ssize_t n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+  EXPECT_TRUE(n > 0 && std::string(buffer, n).find(
+                           "101 Switching Protocols") != std::string::npos);
+
+  // a broadcast wakes up a host blocked in PollOnce() with nothing to do
+  auto start = std::chrono::steady_clock::now();
+  std::thread host([&server] {
+    server.PollOnce(0, std::chrono::milliseconds(2000));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  server.Broadcast("/events", WebSocketOpcode::kText, "news");
+  host.join();
+  EXPECT_TRUE(std::chrono::steady_clock::now() - start <
+              std::chrono::milliseconds(1000));
+  n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+  EXPECT_TRUE(n > 0 && std::string(buffer, n) ==
+                           encode_websocket_frame(WebSocketOpcode::kText,
+                                                  "news"));
+  close(fd);
+  server.Stop(std::chrono::milliseconds(100));
+}
+
+void test_tracer() {
+  Tracer tracer(2, 2);
+  TraceSpan span;
+  std::uint64_t now = trace_clock();
+  span.timestamps[static_cast<size_t>(TracePhase::kReceived)] = now;
+  span.timestamps[static_cast<size_t>(TracePhase::kParsed)] = now + 100;
+  span.timestamps[static_cast<size_t>(TracePhase::kSent)] = now + 300;
+  span.fd = 42;
+  // the ring keeps the last two spans of each worker
+  for (int i = 0; i < 3; i++) tracer.Commit(1, span);
+
+  std::ostringstream out;
+  tracer.WriteChromeTrace(out);
+  std::string trace = out.str();
+  auto count = [&](const std::string& s) {
+    size_t n = 0;
+    for (size_t i = trace.find(s); i != std::string::npos;
+         i = trace.find(s, i + 1)) {
+      n++;
+    }
+    return n;
+  };
+  EXPECT_TRUE(count("\"name\":\"request\"") == 2);
+  EXPECT_TRUE(count("\"name\":\"parse\"") == 2);
+  // the handler phase was skipped, the send part starts once parsed
+  EXPECT_TRUE(count("\"name\":\"handler\"") == 0);
+  EXPECT_TRUE(count("\"name\":\"send\"") == 2);
+  EXPECT_TRUE(count("\"tid\":2,\"args\":{\"fd\":42}") == 6);
+  EXPECT_TRUE(trace.find("\"name\":\"worker 1\"") != std::string::npos);
+}
+
 int main(void) {
   std::cout << "Running tests..." << std::endl;
 
@@ -90,6 +1526,31 @@ int main(void) {
   test_string_to_version();
   test_request_to_string();
   test_response_to_string();
+  test_string_to_request_version();
+  test_string_to_request_header_fields();
+  test_persistent_connection();
+  test_pass_file_descriptors();
+  test_token_bucket();
+  test_admission_controller();
+  test_response_framer();
+  test_large_response();
+  test_graceful_drain();
+  test_listener_handoff();
+  test_reverse_proxy();
+  test_multiple_listeners();
+  test_prefork_server();
+  test_content_bundle();
+  test_worker_distributor();
+  test_connection_migration();
+  test_batched_pipeline();
+  test_external_event_loop();
+  test_spsc_ring();
+  test_access_log();
+  test_tls();
+  test_websocket_frames();
+  test_websocket_server();
+  test_external_loop_broadcast();
+  test_tracer();
 
   std::cout << "All tests have finished. There were " << err
             << " errors in total" << std::endl;
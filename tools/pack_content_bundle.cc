@@ -0,0 +1,171 @@
+// Packs the files of a directory into a content bundle that the server can
+// map with MountContentBundle().
+//
+// Usage: pack_content_bundle [--gzip] <directory> <output>
+//
+// Each file is served at its path relative to the directory, lowercased,
+// and index.html files also at the path of their directory. With --gzip,
+// text files also get a gzip variant when it is smaller.
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "content_bundle.h"
+
+using simple_http_server::BundleFile;
+
+namespace {
+
+// Files smaller than this gain nothing from compression
+constexpr size_t kMinGzipSize = 256;
+
+struct ContentType {
+  const char* type;
+  bool compressible;
+};
+
+const std::map<std::string, ContentType> kContentTypes = {
+    {"css", {"text/css; charset=utf-8", true}},
+    {"gif", {"image/gif", false}},
+    {"htm", {"text/html; charset=utf-8", true}},
+    {"html", {"text/html; charset=utf-8", true}},
+    {"ico", {"image/x-icon", true}},
+    {"jpeg", {"image/jpeg", false}},
+    {"jpg", {"image/jpeg", false}},
+    {"js", {"text/javascript; charset=utf-8", true}},
+    {"json", {"application/json", true}},
+    {"map", {"application/json", true}},
+    {"mjs", {"text/javascript; charset=utf-8", true}},
+    {"png", {"image/png", false}},
+    {"svg", {"image/svg+xml", true}},
+    {"txt", {"text/plain; charset=utf-8", true}},
+    {"wasm", {"application/wasm", true}},
+    {"webp", {"image/webp", false}},
+    {"woff", {"font/woff", false}},
+    {"woff2", {"font/woff2", false}},
+    {"xml", {"application/xml", true}},
+};
+
+const ContentType kDefaultContentType = {"application/octet-stream", false};
+
+const ContentType& content_type(const std::string& path) {
+  size_t dot = path.rfind('.');
+  if (dot == std::string::npos || path.find('/', dot) != std::string::npos) {
+    return kDefaultContentType;
+  }
+  auto it = kContentTypes.find(path.substr(dot + 1));
+  return it != kContentTypes.end() ? it->second : kDefaultContentType;
+}
+
+std::string gzip(const std::string& content) {
+  z_stream stream = {};
+  // 15 window bits, plus 16 for a gzip header instead of a zlib one
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("Failed to initialize zlib");
+  }
+  std::string compressed(deflateBound(&stream, content.length()), '\0');
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+  stream.avail_in = content.length();
+  stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_out = compressed.length();
+  int result = deflate(&stream, Z_FINISH);
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) throw std::runtime_error("Failed to compress");
+  return compressed;
+}
+
+// Adds the files under `directory` to `files`, served under `url_path`
+void add_directory(const std::string& directory, const std::string& url_path,
+                   bool use_gzip, std::vector<BundleFile>* files) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir == nullptr) {
+    throw std::runtime_error("Cannot open directory " + directory);
+  }
+  std::vector<std::string> names;
+  while (dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name != "." && name != "..") names.push_back(name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (const auto& name : names) {
+    std::string path = directory + "/" + name;
+    std::string url = url_path + name;
+    std::transform(url.begin(), url.end(), url.begin(),
+                   [](unsigned char c) { return tolower(c); });
+    struct stat status;
+    if (stat(path.c_str(), &status) < 0) {
+      throw std::runtime_error("Cannot read " + path);
+    }
+    if (S_ISDIR(status.st_mode)) {
+      add_directory(path, url + "/", use_gzip, files);
+      continue;
+    }
+    if (!S_ISREG(status.st_mode)) continue;
+
+    std::ifstream in(path, std::ios::binary);
+    BundleFile file;
+    file.content.assign(std::istreambuf_iterator<char>(in),
+                        std::istreambuf_iterator<char>());
+    if (!in && !in.eof()) throw std::runtime_error("Cannot read " + path);
+    const ContentType& type = content_type(url);
+    file.content_type = type.type;
+    file.paths.push_back(url);
+    if (url.length() >= 11 &&
+        url.compare(url.length() - 11, 11, "/index.html") == 0) {
+      file.paths.push_back(url.substr(0, url.length() - 10));
+    }
+    if (use_gzip && type.compressible &&
+        file.content.length() >= kMinGzipSize) {
+      std::string compressed = gzip(file.content);
+      if (compressed.length() < file.content.length()) {
+        file.gzip_content = compressed;
+      }
+    }
+    files->push_back(std::move(file));
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::string> args(argv + 1, argv + argc);
+  bool use_gzip = false;
+  if (!args.empty() && args[0] == "--gzip") {
+    use_gzip = true;
+    args.erase(args.begin());
+  }
+  if (args.size() != 2) {
+    std::cerr << "Usage: " << argv[0] << " [--gzip] <directory> <output>"
+              << std::endl;
+    return 2;
+  }
+
+  try {
+    std::vector<BundleFile> files;
+    add_directory(args[0], "/", use_gzip, &files);
+    simple_http_server::pack_content_bundle(files, args[1]);
+    std::cout << "Packed " << files.size() << " files into " << args[1]
+              << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << "An error occurred: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}